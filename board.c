@@ -166,6 +166,18 @@ void ChessBoard_from_FEN(ChessBoard *board, char *fen) {
     board->bitboards[all_pieces + all] = board->bitboards[all_pieces + white] |
                                          board->bitboards[all_pieces + black];
 
+    // Set mailbox
+    memset(board->mailbox, empty, sizeof(board->mailbox));
+    for (Piece piece = pawn; piece <= king; piece += 2) {
+        u64 bb =
+            board->bitboards[white + piece] | board->bitboards[black + piece];
+        while (bb) {
+            int sq = __builtin_ctzll(bb);
+            board->mailbox[sq] = piece;
+            BB_CLEAR(bb, sq);
+        }
+    }
+
     // Set side to move
     board->side = fen[i] == 'w' ? white : black;
     i += 2;  // space and skip
@@ -346,33 +358,17 @@ void ChessBoard_to_FEN(ChessBoard *board, char *str) {
 }
 
 Piece ChessBoard_piece_at(ChessBoard *board, int ind) {
-    u64 loc = 1ULL << ind;
-    if ((board->bitboards[all_pieces + all] & loc) == 0) {
-        return empty;
-    }
-    if (board->bitboards[all_pieces + white] & loc) {
-        for (Piece piece = pawn; piece <= king; piece++) {
-            if (board->bitboards[white + piece] & loc) {
-                return piece;
-            }
-        }
-    } else {
-        for (Piece piece = pawn; piece <= king; piece++) {
-            if (board->bitboards[black + piece] & loc) {
-                return piece;
-            }
-        }
-    }
-
-    fprintf(stderr, "Error: piece_at called on empty square [%s(%s):%d]\n",
-            __FILE__, __func__, __LINE__);
-    exit(1);
+    return board->mailbox[ind];
 }
 
-void global_init(void) {
+void init_board_globals(void) {
     init_genrand64(0x8c364d19345930e2);
     init_zobrist();
     init_LookupTable();
-    init_hash_table();
     init_tables();
 }
+
+void global_init(void) {
+    init_board_globals();
+    init_hash_table();
+}
@@ -17,6 +17,8 @@ void print_bb(u64 bb);
 u64 make_bitboard(char *str);
 
 // Bitboard
+struct AttackCache;
+
 typedef struct {
     // BitBoards
     // indexed as bitboards[piece + side]
@@ -24,6 +26,13 @@ typedef struct {
     // black_pieces, 12 + all -> all_pieces
     u64 bitboards[15];
 
+    // Piece on each square (empty if none), kept in sync with the bitboards
+    u8 mailbox[64];
+
+    // Attack cache of the search thread playing on this board, NULL for
+    // none; see attach_attack_cache
+    struct AttackCache *cache;
+
     // Board State
     Side side;
 
@@ -72,6 +81,9 @@ void init_zobrist(void);
 u64 manual_compute_hash(ChessBoard *board);
 
 // init
+// global_init sets up everything, init_board_globals all but the search's
+// hash table, which perft does without
+void init_board_globals(void);
 void global_init(void);
 
 #endif  // CHESS_H
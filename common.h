@@ -6,8 +6,18 @@
 // Types
 typedef uint64_t u64;
 typedef uint16_t u16;
+typedef uint8_t u8;
 typedef int16_t i16;
 
+// Moves: from, to and move type in 16 bits, see movegen.h
+typedef u16 Move;
+
+// Move list entry, the score is only used for ordering
+typedef struct {
+    Move move;
+    i16 score;
+} ExtMove;
+
 // Constant Macros
 #define RANK_1 0xff
 #define RANK_2 0xff00
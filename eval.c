@@ -3,6 +3,7 @@
 
 const i16 INF = 20000;
 const i16 out_of_time = INF + 100;
+const int history_max = 8192;  // 3 tables summed still fit a move score
 int mg_value[6] = {100, 500, 320, 330, 900, 10000};
 int eg_value[6] = {100, 500, 320, 330, 900, 10000};
 // int mg_value[6] = {82, 477, 337, 365, 1025, 0};
@@ -1,58 +1,237 @@
+// posix_memalign, madvise
+#define _GNU_SOURCE
+
 #include "hash_table.h"
 
-#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+
+__extension__ typedef unsigned __int128 u128;
+
+hash_bucket_t *hash_table = NULL;
+u64 hash_buckets = 0;
+
+perft_bucket_t *perft_table = NULL;
+u64 perft_buckets = 0;
+
+// search generation, stored in each entry so that entries left over from
+// previous searches can be told apart from fresh ones
+static u16 generation = 0;
+
+void init_hash_table(void) {
+    if (hash_table == NULL) {
+        resize_hash_table(HASH_TABLE_MB);
+    } else {
+        clear_hash_table();
+    }
+}
+
+// Allocates `mb` megabytes (clamped to the table limits), aligned to 2MB so
+// the kernel can back the table with transparent huge pages
+static void *alloc_table(u64 *mb) {
+    const size_t huge_page = 2 * 1024 * 1024;
+    size_t bytes;
+    void *mem;
+
+    if (*mb < 1) *mb = 1;
+    if (*mb > HASH_TABLE_MAX_MB) *mb = HASH_TABLE_MAX_MB;
+    bytes = *mb * 1024 * 1024;
+
+    if (posix_memalign(&mem, huge_page, bytes) != 0) {
+        fprintf(stderr,
+                "Error: could not allocate %lluMB hash table [%s(%s):%d]\n",
+                (unsigned long long)*mb, __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(mem, bytes, MADV_HUGEPAGE);
+#endif
+
+    return mem;
+}
 
-#include "rng.h"
+// (Re)allocates the table with `mb` megabytes. The bucket count need not be
+// a power of two, see bucket_of.
+void resize_hash_table(u64 mb) {
+    free(hash_table);
+    hash_table = alloc_table(&mb);
+    hash_buckets = mb * 1024 * 1024 / sizeof(hash_bucket_t);
+    clear_hash_table();
+}
 
-hash_entry_t hash_table[HASH_TABLE_SIZE];
+void clear_hash_table(void) {
+    memset(hash_table, 0, hash_buckets * sizeof(hash_bucket_t));
+    generation = 0;
+}
 
-void init_hash_table(void) { memset(hash_table, 0, sizeof(hash_table)); }
+// called once per search, before the first probe
+void age_hash_table(void) { generation = (generation + 1) & 0xFF; }
 
 // helpers
 hash_flag_t hf_flag(u64 entry) { return entry & 0x3; }
 
 i16 hf_score(u64 entry) { return entry >> 2 & 0xFFFF; }
 
-u16 hf_depth(u64 entry) { return entry >> 18 & 0xFFFF; }
+u16 hf_depth(u64 entry) { return entry >> 18 & 0xFF; }
+
+u16 hf_generation(u64 entry) { return entry >> 26 & 0xFF; }
+
+Move hf_move(u64 entry) { return entry >> 34 & 0xFFFF; }
+
+// maps the hash onto [0, buckets) with a multiply-shift, which works for any
+// table size and costs one multiplication instead of a division
+static u64 index_of(u64 hash, u64 buckets) {
+    return (u64)(((u128)hash * buckets) >> 64);
+}
+
+static hash_bucket_t *bucket_of(u64 hash) {
+    return &hash_table[index_of(hash, hash_buckets)];
+}
+
+// number of searches since entry was last written (mod 256)
+static int entry_age(u64 entry) {
+    return (generation - hf_generation(entry)) & 0xFF;
+}
+
+// Lock-free access: a slot holds key = hash ^ entry next to the entry. A
+// reader racing a writer may see the key of one store and the entry of
+// another, in which case key ^ entry no longer matches the hash and the slot
+// reads as a miss. Each word is accessed atomically so it can't tear itself.
+static u64 load_word(u64 *word) {
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+
+static void store_word(u64 *word, u64 value) {
+    __atomic_store_n(word, value, __ATOMIC_RELAXED);
+}
+
+// lower is a better candidate for replacement: shallow and old entries go
+// first, empty slots before anything else
+static int replace_value(u64 key, u64 entry) {
+    if (key == 0 && entry == 0) return -(1 << 16);
+    return hf_depth(entry) - 8 * entry_age(entry);
+}
 
-u64 hf_move(u64 entry) { return entry >> 34 & 0x3FFFFFFFULL; }
+// slot to write `hash` into: the slot holding the same position if there is
+// one, otherwise the least valuable slot of the bucket. `*old` is set to the
+// entry found in the slot if it holds the same position, else 0.
+static hash_entry_t *find_slot(u64 hash, u64 *old) {
+    hash_bucket_t *bucket = bucket_of(hash);
+    hash_entry_t *victim = NULL;
+    int victim_value = 0;
+
+    *old = 0;
+    for (int i = 0; i < BUCKET_SIZE; i++) {
+        hash_entry_t *e = &bucket->entries[i];
+        u64 key = load_word(&e->key), entry = load_word(&e->entry);
+        if ((key ^ entry) == hash) {
+            *old = entry;
+            return e;
+        }
+
+        int value = replace_value(key, entry);
+        if (victim == NULL || value < victim_value) {
+            victim = e;
+            victim_value = value;
+        }
+    }
+    return victim;
+}
+
+static void write_slot(hash_entry_t *slot, u64 hash, u64 entry) {
+    store_word(&slot->key, hash ^ entry);
+    store_word(&slot->entry, entry);
+}
 
 // hash fns
 u64 probe(u64 hash) {
-    // We use a simple hash table, no buckets, always replace
-    // TODO Update to bucketed version
-    u64 ind = hash & HASH_TABLE_AND;
-    if (hash_table[ind].hash == hash &&
-        hf_depth(hash_table[ind].entry) == UINT16_MAX) {
-        // bad entry
-        assert(0);
+    hash_bucket_t *bucket = bucket_of(hash);
+    for (int i = 0; i < BUCKET_SIZE; i++) {
+        hash_entry_t *e = &bucket->entries[i];
+        u64 key = load_word(&e->key), entry = load_word(&e->entry);
+        if ((key ^ entry) == hash) return entry;
     }
-    return hash_table[ind].hash == hash ? hash_table[ind].entry : 0;
+    return 0;
 }
 
-void store(u64 hash, hash_flag_t flag, i16 score, u16 depth, u64 move) {
-    // prefer deepest search
-    u64 ind = hash & HASH_TABLE_AND;
+void store(u64 hash, hash_flag_t flag, i16 score, u16 depth, Move move) {
+    u64 old;
+    hash_entry_t *slot = find_slot(hash, &old);
 
-    u16 existing_depth = hf_depth(hash_table[ind].entry);
-    if (existing_depth >= depth) return;
+    if (depth > 0xFF) depth = 0xFF;
+
+    // same position: prefer deepest search, unless the old entry is stale
+    if (old) {
+        if (hf_depth(old) > depth && entry_age(old) == 0 && flag != exact)
+            return;
+
+        // keep the old move rather than losing it to a moveless bound
+        if (move == 0) move = hf_move(old);
+    }
 
-    move &= 0xFFFFFFFULL;
     // Note bit magic: score & 0xFFFF causes score to promote to unsigned
     // without sign extension
     u64 entry = (u64)flag | (u64)(score & 0xFFFF) << 2 | (u64)depth << 18 |
-                (u64)move << 34;
-    hash_table[ind].hash = hash;
-    hash_table[ind].entry = entry;
-    if (hf_depth(hash_table[ind].entry) == UINT16_MAX) {
-        // bad entry
-        assert(0);
+                (u64)generation << 26 | (u64)move << 34;
+    write_slot(slot, hash, entry);
+}
+
+// perft table
+void resize_perft_table(u64 mb) {
+    free(perft_table);
+    perft_table = alloc_table(&mb);
+    perft_buckets = mb * 1024 * 1024 / sizeof(perft_bucket_t);
+    clear_perft_table();
+}
+
+void clear_perft_table(void) {
+    memset(perft_table, 0, perft_buckets * sizeof(perft_bucket_t));
+}
+
+static u64 perft_lock(u64 hash, int depth) {
+    return (hash & ~0xFFULL) | (depth & 0xFF);
+}
+
+int perft_probe(u64 hash, int depth, u64 *nodes) {
+    perft_bucket_t *bucket = &perft_table[index_of(hash, perft_buckets)];
+    u64 lock = perft_lock(hash, depth);
+
+    for (int i = 0; i < BUCKET_SIZE; i++) {
+        perft_entry_t *e = &bucket->entries[i];
+        u64 key = load_word(&e->key), count = load_word(&e->nodes);
+        if ((key ^ count) == lock) {
+            *nodes = count;
+            return 1;
+        }
     }
+    return 0;
 }
 
-void raw_store(u64 hash, u64 entry) {
-    u64 ind = hash & HASH_TABLE_AND;
-    hash_table[ind].hash = hash;
-    hash_table[ind].entry = entry;
+// Replaces the shallowest entry of the bucket (empty slots read as depth 0),
+// since deeper entries save more work when they hit
+void perft_store(u64 hash, int depth, u64 nodes) {
+    perft_bucket_t *bucket = &perft_table[index_of(hash, perft_buckets)];
+    u64 lock = perft_lock(hash, depth);
+    perft_entry_t *victim = NULL;
+    int victim_depth = 0;
+
+    for (int i = 0; i < BUCKET_SIZE; i++) {
+        perft_entry_t *e = &bucket->entries[i];
+        u64 old = load_word(&e->key) ^ load_word(&e->nodes);
+        if (old == lock) {
+            victim = e;
+            break;
+        }
+
+        int old_depth = old & 0xFF;
+        if (victim == NULL || old_depth < victim_depth) {
+            victim = e;
+            victim_depth = old_depth;
+        }
+    }
+
+    store_word(&victim->key, lock ^ nodes);
+    store_word(&victim->nodes, nodes);
 }
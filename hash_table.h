@@ -3,38 +3,76 @@
 
 #include "common.h"
 
-// 1 << 23 -> 128MB hash table
-#define HASH_TABLE_SIZE (1 << 23)
-#define HASH_TABLE_AND (HASH_TABLE_SIZE - 1);
+// default size in MB, changed at runtime with resize_hash_table
+#define HASH_TABLE_MB 128
+#define HASH_TABLE_MAX_MB 65536
+
+// 4 entries * 16 bytes -> one 64 byte cache line per bucket
+#define BUCKET_SIZE 4
 
 // entry:
-// low, high, exact       : 0-2
-// score (-20000 - 20000) : 3-18
-// depth                  : 19-25
-// move                   : 26-64
+// low, high, exact       : 0-1
+// score (-20000 - 20000) : 2-17
+// depth                  : 18-25
+// generation             : 26-33
+// move                   : 34-49
 typedef enum {
     lower = 0,
     higher = 1,
     exact = 2,
 } hash_flag_t;
 
+// key is hash ^ entry, so that a torn write (key and entry from different
+// stores) is rejected by probe; this makes the table safe to share between
+// search threads without locking
 typedef struct {
-    u64 hash;
+    u64 key;
     u64 entry;
 } hash_entry_t;
 
-extern hash_entry_t hash_table[HASH_TABLE_SIZE];
+typedef struct {
+    hash_entry_t entries[BUCKET_SIZE];
+} __attribute__((aligned(64))) hash_bucket_t;
+
+extern hash_bucket_t *hash_table;
+extern u64 hash_buckets;
 
 // hash table
 void init_hash_table(void);
+void resize_hash_table(u64 mb);
+void clear_hash_table(void);
+void age_hash_table(void);
 u64 probe(u64 hash);
-void store(u64 hash, hash_flag_t flag, i16 score, u16 depth, u64 move);
-void raw_store(u64 hash, u64 entry);
+void store(u64 hash, hash_flag_t flag, i16 score, u16 depth, Move move);
 
 // helpers
 hash_flag_t hf_flag(u64 entry);
 i16 hf_score(u64 entry);
 u16 hf_depth(u64 entry);
-u64 hf_move(u64 entry);
+u16 hf_generation(u64 entry);
+Move hf_move(u64 entry);
+
+// Perft table, separate from the search table and only allocated by
+// resize_perft_table. Entries are keyed by (hash, depth): the low 8 bits
+// of the hash are replaced by the depth, and key is that lock ^ nodes for
+// the same torn-write check as above.
+
+typedef struct {
+    u64 key;
+    u64 nodes;
+} perft_entry_t;
+
+typedef struct {
+    perft_entry_t entries[BUCKET_SIZE];
+} __attribute__((aligned(64))) perft_bucket_t;
+
+extern perft_bucket_t *perft_table;
+extern u64 perft_buckets;
+
+// perft table
+void resize_perft_table(u64 mb);
+void clear_perft_table(void);
+int perft_probe(u64 hash, int depth, u64 *nodes);
+void perft_store(u64 hash, int depth, u64 nodes);
 
 #endif  // HASH_TABLE_H
@@ -10,17 +10,22 @@ LookupTable lookup;
 u64 find_magic(u64 *mask, int sq, Piece p) {
     u64 magic, subset, occupancy;
     u64 moves[4096] = {0};  // Initialize to zero
-    int ind, shift_amt;
+    int ind, bits, shift_amt;
 
+    (void)p;
     occupancy = mask[sq];
-    shift_amt = p == rook ? (64 - 12) : (64 - 9);
+    bits = __builtin_popcountll(occupancy);
+    shift_amt = 64 - bits;
 
     for (int loop_cnt = 0; loop_cnt < (1 << 24); loop_cnt++) {
         // Make random number fairly sparse (3 &s work well in practice)
         magic = genrand64_int64() & genrand64_int64() & genrand64_int64();
 
+        // Good magics spread the mask into the top bits, skip ones that don't
+        if (__builtin_popcountll((occupancy * magic) >> 56) < 6) continue;
+
         // Clear the moves array
-        memset(moves, 0, sizeof(moves));
+        memset(moves, 0, sizeof(moves[0]) << bits);
 
         // Trick to iterate through subsets quickly (Carry-Rippler)
         subset = 0;
@@ -47,6 +52,17 @@ u64 find_magic(u64 *mask, int sq, Piece p) {
     return (u64)-1;  // failure
 }
 
+// Packed table layout: each square gets 2^popcount(mask) entries
+void gen_offsets(u64 *mask, int *shift, int *offset) {
+    int next = 0;
+    for (int sq = 0; sq < 64; sq++) {
+        int bits = __builtin_popcountll(mask[sq]);
+        shift[sq] = 64 - bits;
+        offset[sq] = next;
+        next += 1 << bits;
+    }
+}
+
 // Rook magics
 void gen_occupancy_rook(void) {
     u64 *mask = lookup.rook_mask;
@@ -118,13 +134,16 @@ u64 manual_gen_rook_moves(u64 bb, int sq) {
     return moves;
 }
 
+// move points at sq's entries in the packed table
 void fill_rook_moves(u64 *move, u64 mask, u64 magic, int sq) {
+    int shift_amt = 64 - __builtin_popcountll(mask);
+
     // Subset iteration trick (Carry-Rippler)
     u64 subset = 0;
     while (1) {
-        int ind = (subset * magic) >> (64 - 12);
+        int ind = (subset * magic) >> shift_amt;
         u64 mv = manual_gen_rook_moves(subset, sq);
-        move[4096 * sq + ind] = mv;
+        move[ind] = mv;
 
         subset = (subset - mask) & mask;
         if (subset == 0) break;
@@ -211,19 +230,55 @@ u64 manual_gen_bishop_moves(u64 bb, int sq) {
     return moves;
 }
 
+// move points at sq's entries in the packed table
 void fill_bishop_moves(u64 *move, u64 mask, u64 magic, int sq) {
+    int shift_amt = 64 - __builtin_popcountll(mask);
+
     // Subset iteration trick (Carry-Rippler)
     u64 subset = 0;
     while (1) {
-        int ind = (subset * magic) >> (64 - 9);
+        int ind = (subset * magic) >> shift_amt;
         u64 mv = manual_gen_bishop_moves(subset, sq);
-        move[512 * sq + ind] = mv;
+        move[ind] = mv;
 
         subset = (subset - mask) & mask;
         if (subset == 0) break;
     }
 }
 
+// PEXT tables
+// Software pdep: deposits the low bits of src into the set bits of mask,
+// the inverse of pext. Only used to fill the tables.
+u64 pdep(u64 src, u64 mask) {
+    u64 res = 0;
+    for (u64 bit = 1; mask; bit <<= 1) {
+        if (src & bit) res |= mask & -mask;
+        mask &= mask - 1;
+    }
+    return res;
+}
+
+int pext_supported(void) {
+#ifdef HAS_PEXT
+    __builtin_cpu_init();
+    // Zen 1 and 2 implement pext in microcode, slower than a magic multiply
+    return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("znver1") &&
+           !__builtin_cpu_is("znver2");
+#else
+    return 0;
+#endif
+}
+
+void fill_pext_moves(u64 *move, u64 *mask, int *offset,
+                     u64 (*gen)(u64, int)) {
+    for (int sq = 0; sq < 64; sq++) {
+        int n = 1 << __builtin_popcountll(mask[sq]);
+        for (int i = 0; i < n; i++) {
+            move[offset[sq] + i] = gen(pdep(i, mask[sq]), sq);
+        }
+    }
+}
+
 void gen_king_moves(void) {
     u64 *bb = lookup.king_move;
     u64 moves;
@@ -274,22 +329,71 @@ void gen_knight_moves(void) {
     }
 }
 
+void gen_pawn_attacks(void) {
+    for (int sq = 0; sq < 64; sq++) {
+        u64 bb = BB_SQUARE(sq);
+        lookup.pawn_attack[white][sq] =
+            (bb & ~FILE_1) << 9 | (bb & ~FILE_8) << 7;
+        lookup.pawn_attack[black][sq] =
+            (bb & ~FILE_1) >> 7 | (bb & ~FILE_8) >> 9;
+    }
+}
+
+void gen_between_and_line(void) {
+    for (int a = 0; a < 64; a++) {
+        for (int b = 0; b < 64; b++) {
+            lookup.between[a][b] = 0;
+            lookup.line[a][b] = 0;
+            if (a == b) continue;
+
+            u64 ends = BB_SQUARE(a) | BB_SQUARE(b);
+            if (manual_gen_rook_moves(0, a) & BB_SQUARE(b)) {
+                lookup.line[a][b] = (manual_gen_rook_moves(0, a) &
+                                     manual_gen_rook_moves(0, b)) |
+                                    ends;
+                lookup.between[a][b] =
+                    manual_gen_rook_moves(BB_SQUARE(b), a) &
+                    manual_gen_rook_moves(BB_SQUARE(a), b);
+            } else if (manual_gen_bishop_moves(0, a) & BB_SQUARE(b)) {
+                lookup.line[a][b] = (manual_gen_bishop_moves(0, a) &
+                                     manual_gen_bishop_moves(0, b)) |
+                                    ends;
+                lookup.between[a][b] =
+                    manual_gen_bishop_moves(BB_SQUARE(b), a) &
+                    manual_gen_bishop_moves(BB_SQUARE(a), b);
+            }
+        }
+    }
+}
+
 void init_LookupTable(void) {
     // Magics
     gen_occupancy_bishop();
     gen_occupancy_rook();
+    gen_offsets(lookup.bishop_mask, lookup.bishop_shift, lookup.bishop_offset);
+    gen_offsets(lookup.rook_mask, lookup.rook_shift, lookup.rook_offset);
 
     for (int i = 0; i < 64; i++) {
-        lookup.bishop_magic[i] = find_magic(lookup.bishop_mask, i, bishop);
-        fill_bishop_moves(lookup.bishop_move, lookup.bishop_mask[i],
-                          lookup.bishop_magic[i], i);
+        lookup.bishop_magic[i] = bishop_magics[i];
+        fill_bishop_moves(lookup.bishop_move + lookup.bishop_offset[i],
+                          lookup.bishop_mask[i], lookup.bishop_magic[i], i);
 
-        lookup.rook_magic[i] = find_magic(lookup.rook_mask, i, rook);
-        fill_rook_moves(lookup.rook_move, lookup.rook_mask[i],
-                        lookup.rook_magic[i], i);
+        lookup.rook_magic[i] = rook_magics[i];
+        fill_rook_moves(lookup.rook_move + lookup.rook_offset[i],
+                        lookup.rook_mask[i], lookup.rook_magic[i], i);
     }
 
+    fill_pext_moves(lookup.bishop_pext, lookup.bishop_mask,
+                    lookup.bishop_offset, manual_gen_bishop_moves);
+    fill_pext_moves(lookup.rook_pext, lookup.rook_mask, lookup.rook_offset,
+                    manual_gen_rook_moves);
+    lookup.use_pext = pext_supported();
+
     // Other pieces
     gen_king_moves();
     gen_knight_moves();
+    gen_pawn_attacks();
+
+    // Lines, for pins and check evasions
+    gen_between_and_line();
 }
@@ -10,17 +10,47 @@
 #include "board.h"
 #include "common.h"
 
+// PEXT slider attacks are available on x86-64 unless built with -DNO_PEXT,
+// and used when the CPU supports them (see pext_supported)
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_PEXT)
+#define HAS_PEXT 1
+#endif
+
+// Slider attacks are stored packed: square sq's entries start at
+// *_offset[sq] and there are 2^popcount(mask) of them, indexed either by a
+// magic multiply shifted right by *_shift[sq] ("fancy" magics) or by
+// pext(occupancy, mask). Sizes are the sums over all squares.
+#define BISHOP_ATTACKS_SIZE 5248
+#define ROOK_ATTACKS_SIZE 102400
+
 typedef struct {
     u64 bishop_magic[64];
     u64 bishop_mask[64];
-    u64 bishop_move[512 * 64];
+    int bishop_shift[64];
+    int bishop_offset[64];
+    u64 bishop_move[BISHOP_ATTACKS_SIZE];
 
     u64 rook_magic[64];
     u64 rook_mask[64];
-    u64 rook_move[4096 * 64];
+    int rook_shift[64];
+    int rook_offset[64];
+    u64 rook_move[ROOK_ATTACKS_SIZE];
+
+    // same layout as *_move, indexed by pext
+    u64 bishop_pext[BISHOP_ATTACKS_SIZE];
+    u64 rook_pext[ROOK_ATTACKS_SIZE];
+    int use_pext;
 
     u64 king_move[64];
     u64 knight_move[64];
+
+    // pawn_attack[side][sq]: squares attacked by a pawn of side on sq
+    u64 pawn_attack[2][64];
+
+    // squares strictly between two aligned squares, and the full line
+    // through them (0 if not on a common rank, file or diagonal)
+    u64 between[64][64];
+    u64 line[64][64];
 } LookupTable;
 
 extern LookupTable lookup;
@@ -28,6 +58,13 @@ extern LookupTable lookup;
 // Magic gen
 u64 find_magic(u64 *mask_table, int sq, Piece p);
 
+// Precomputed magics, see magic_gen.c
+extern const u64 bishop_magics[64];
+extern const u64 rook_magics[64];
+
+// Packed table layout
+void gen_offsets(u64 *mask, int *shift, int *offset);
+
 // Rooks
 void gen_occupancy_rook(void);
 u64 manual_gen_rook_moves(u64 bb, int square);
@@ -38,9 +75,17 @@ void gen_occupancy_bishop(void);
 u64 manual_gen_bishop_moves(u64 bb, int square);
 void fill_bishop_moves(u64 *move, u64 mask, u64 magic, int sq);
 
+// PEXT
+u64 pdep(u64 src, u64 mask);
+int pext_supported(void);
+void fill_pext_moves(u64 *move, u64 *mask, int *offset,
+                     u64 (*gen)(u64, int));
+
 // Other
 void gen_king_moves(void);
 void gen_knight_moves(void);
+void gen_pawn_attacks(void);
+void gen_between_and_line(void);
 
 // Init
 void init_LookupTable(void);
@@ -0,0 +1,42 @@
+/*
+ * Generates magics.c, the magic numbers used to index the slider attack
+ * tables, so that init_LookupTable doesn't search for them at startup.
+ *
+ * Usage: make magics
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "lookup.h"
+#include "rng.h"
+
+void print_magics(char *name, u64 *mask, Piece p) {
+    printf("const u64 %s[64] = {", name);
+    for (int sq = 0; sq < 64; sq++) {
+        u64 magic = find_magic(mask, sq, p);
+        if (magic == (u64)-1) {
+            fprintf(stderr, "Error: no magic found for square %d [%s(%s):%d]\n",
+                    sq, __FILE__, __func__, __LINE__);
+            exit(1);
+        }
+        printf(sq % 3 ? " " : "\n    ");
+        printf("0x%016llxULL,", (unsigned long long)magic);
+    }
+    printf("\n};\n");
+}
+
+int main(void) {
+    init_genrand64(0x8c364d19345930e2);
+    gen_occupancy_bishop();
+    gen_occupancy_rook();
+
+    printf("// Generated by magic_gen.c (make magics), do not edit\n\n");
+    printf("#include \"lookup.h\"\n\n");
+    print_magics("bishop_magics", lookup.bishop_mask, bishop);
+    printf("\n");
+    print_magics("rook_magics", lookup.rook_mask, rook);
+
+    return 0;
+}
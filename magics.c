@@ -0,0 +1,53 @@
+// Generated by magic_gen.c (make magics), do not edit
+
+#include "lookup.h"
+
+const u64 bishop_magics[64] = {
+    0x1042108108010040ULL, 0x0008210104050020ULL, 0x3010008081100108ULL,
+    0xd204440480000000ULL, 0x0214142108000000ULL, 0x0012011108141800ULL,
+    0x010200a208420000ULL, 0x8000128c10080408ULL, 0x0200600212680100ULL,
+    0x0400240800e40080ULL, 0x20001001020c2040ULL, 0x2800022082000040ULL,
+    0x4680411040c20808ULL, 0x9014020804043a00ULL, 0x4000008410421090ULL,
+    0x0000802484501820ULL, 0x8050480a20010402ULL, 0x58a01044a40c0040ULL,
+    0x0010800808084008ULL, 0x8104000802400a08ULL, 0x0000800408a01020ULL,
+    0x8202001304420200ULL, 0x8003100058021080ULL, 0x1001181200420204ULL,
+    0x048208302008100aULL, 0x0004040202e80800ULL, 0x0002110008024400ULL,
+    0x2a2e020020088008ULL, 0x0286001002005002ULL, 0x04080201008a0113ULL,
+    0x0208020020820140ULL, 0x0201060000289400ULL, 0x0808080500410440ULL,
+    0x0002013080041000ULL, 0x0004020200010400ULL, 0x1001340108040100ULL,
+    0x8040008208410100ULL, 0x8104180201002080ULL, 0x03e2480200084203ULL,
+    0x30120082180d0048ULL, 0x200082201002a000ULL, 0x0984014450010240ULL,
+    0x0003004030098600ULL, 0x0191802018000100ULL, 0x0000202009001880ULL,
+    0x0082008302000305ULL, 0x0010010144021108ULL, 0x0201010206009080ULL,
+    0x120092300e600000ULL, 0x2830413801100082ULL, 0x8412002084100801ULL,
+    0x0004205020880080ULL, 0x0940109020484000ULL, 0x0000450810011151ULL,
+    0x00c0048812006200ULL, 0x01480810808202a1ULL, 0x8001144508084030ULL,
+    0x00240e0201414800ULL, 0x0000000046009040ULL, 0x9880400259048800ULL,
+    0x0206000a60452400ULL, 0x000e210410100244ULL, 0x0000128208082280ULL,
+    0xc020024210450600ULL,
+};
+
+const u64 rook_magics[64] = {
+    0x188000c004208810ULL, 0x04c0300020004000ULL, 0x0200081200208040ULL,
+    0x0100052109001000ULL, 0x0600082a00200410ULL, 0x4100080100020400ULL,
+    0xa080008002000100ULL, 0x2080044080102100ULL, 0x0244800028400081ULL,
+    0x1280401000200040ULL, 0x0260801000802002ULL, 0x0002000812022040ULL,
+    0x0009000410080100ULL, 0x0290800400d20080ULL, 0x0009000402000100ULL,
+    0x8001000061000082ULL, 0x0080004040002000ULL, 0x1010004040002000ULL,
+    0x004e060020408210ULL, 0x000101000c201000ULL, 0x0800050011000800ULL,
+    0x0300808004000200ULL, 0x8000440022080130ULL, 0x1104020008805114ULL,
+    0x4000401480002681ULL, 0x0008810200244200ULL, 0x0020008080100020ULL,
+    0x4818100080080084ULL, 0x0041000500080010ULL, 0x0288400801208410ULL,
+    0x0805000d00041200ULL, 0x3000008200084114ULL, 0x0080004000402000ULL,
+    0x0244402002401000ULL, 0x0410002400200800ULL, 0x0282000a12004020ULL,
+    0x0081800802800401ULL, 0x0006009002000884ULL, 0x0000492204005058ULL,
+    0x0018006082001104ULL, 0x4000204000908000ULL, 0x0040200050004000ULL,
+    0x1320002010008080ULL, 0x000021001001000cULL, 0x0048003100250008ULL,
+    0x0000102004080140ULL, 0x0108085022040081ULL, 0x0200008424420011ULL,
+    0x00c0408001082700ULL, 0x0020200080401080ULL, 0x2020004010080040ULL,
+    0x3001008810002500ULL, 0x8004040080080080ULL, 0x0a08020004008080ULL,
+    0x0003082902100c00ULL, 0x840020408c050200ULL, 0x0020208000410011ULL,
+    0x2040010260108541ULL, 0x0060144009002001ULL, 0xa009012074100089ULL,
+    0x042200c910042002ULL, 0x0102001084010802ULL, 0x84f0008201481004ULL,
+    0x08000c8c0020410aULL,
+};
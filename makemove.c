@@ -1,5 +1,6 @@
 #include "makemove.h"
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -10,26 +11,27 @@
 #include "movegen.h"
 
 // utilities
-int from(u64 move) { return move & 0x3f; }
+int from(Move move) { return move & 0x3f; }
 
-int to(u64 move) { return move >> 6 & 0x3f; }
+int to(Move move) { return move >> 6 & 0x3f; }
 
-int piece(u64 move) { return move >> 12 & 0xf; }
-
-int captured(u64 move) { return move >> 16 & 0xf; }
-
-int move_type(u64 move) { return move >> 20 & 0xf; }
+int move_type(Move move) {
+    int type = move >> 12;
+    return type >= PROMOTION ? PROMOTION : type;
+}
 
-int promote_type(u64 move) { return move >> 24 & 0xf; }
+int promote_type(Move move) { return ((move >> 12) - PROMOTION + 1) * 2; }
 
-u16 move_value(u64 move) { return move >> 28 & 0xffff; }
+Piece moved_piece(ChessBoard *board, Move move) {
+    return board->mailbox[from(move)];
+}
 
-void update_castling_rights(ChessBoard *board, u64 move) {
-    int from = move & 0x3f;
-    int to = (move >> 6) & 0x3f;
-    Piece piece = (move >> 12) & 0xf;
-    Piece captured = (move >> 16) & 0xf;
+Piece captured_piece(ChessBoard *board, Move move) {
+    return move_type(move) == EN_PASSANT ? pawn : board->mailbox[to(move)];
+}
 
+void update_castling_rights(ChessBoard *board, int from, int to, Piece piece,
+                            Piece captured) {
     // If our king moves
     if (piece == king) {
         board->hash ^=
@@ -69,92 +71,204 @@ void update_castling_rights(ChessBoard *board, u64 move) {
     }
 }
 
-#define ON(a, b, sq)                                \
-    (board.bitboards[(a) + (b)] |= (1ULL << (sq))); \
-    (board.hash ^= zobrist.piece[b][a / 2][sq]);    \
-    (board.mg[b] += mg_table[b][a / 2][sq])
-#define OFF(a, b, sq)                                \
-    (board.bitboards[(a) + (b)] &= ~(1ULL << (sq))); \
-    (board.hash ^= zobrist.piece[b][a / 2][sq]);     \
-    (board.mg[b] -= mg_table[b][a / 2][sq])
+// Attack cache
+// Builds the cache for the board as it stands, the board's moves from here
+// on keep it up to date. Copies of the board must not move while it is in
+// use, make_move leaves the cache behind.
+void attach_attack_cache(ChessBoard *board, AttackCache *cache) {
+    for (int sq = 0; sq < 64; sq++) {
+        cache->attacks[sq] = piece_attacks(board, sq);
+    }
+    cache->num_frames = 0;
+    cache->pending = 0;
+    cache->num_saved = 0;
+    board->cache = cache;
+}
+
+// do_move only records which squares changed, most moves of the search are
+// taken back before anything looks at the cache. The first reader applies
+// the update, saving the entries it overwrites on the cache's stack.
+// Besides the pieces on the changed squares only sliders that see an
+// emptied or filled square need a new entry; a capture leaves `to`
+// occupied, so the rays through it stay.
+void sync_attacks(ChessBoard *board) {
+    AttackCache *cache = board->cache;
+    if (!cache || !cache->pending) return;
+
+    AttackFrame *frame = &cache->frames[cache->num_frames - 1];
+    u64 *bb = board->bitboards;
+    u64 occ = bb[all_pieces + all];
+    u64 changed = frame->occ_changed | BB_SQUARE(frame->to);
+    u64 rooks = bb[white + rook] | bb[black + rook] | bb[white + queen] |
+                bb[black + queen];
+    u64 bishops = bb[white + bishop] | bb[black + bishop] |
+                  bb[white + queen] | bb[black + queen];
+    u64 sliders = 0;
+    int n = cache->num_saved;
+
+    for (u64 sqs = frame->occ_changed; sqs; sqs &= sqs - 1) {
+        int sq = __builtin_ctzll(sqs);
+        sliders |= (get_attacks_occ(occ, sq, rook) & rooks) |
+                   (get_attacks_occ(occ, sq, bishop) & bishops);
+    }
+    sliders &= ~changed;
+
+    while (sliders) {
+        int sq = __builtin_ctzll(sliders);
+        cache->saved_sq[n] = sq;
+        cache->saved_old[n++] = cache->attacks[sq];
+        cache->attacks[sq] = get_attacks(board, sq, board->mailbox[sq]);
+        BB_CLEAR(sliders, sq);
+    }
+
+    while (changed) {
+        int sq = __builtin_ctzll(changed);
+        cache->saved_sq[n] = sq;
+        cache->saved_old[n++] = cache->attacks[sq];
+        cache->attacks[sq] = piece_attacks(board, sq);
+        BB_CLEAR(changed, sq);
+    }
+
+    cache->num_saved = n;
+    cache->pending = 0;
+}
+
+// Records the move do_move just made, for the next reader to apply
+static void push_attack_frame(AttackCache *cache, u64 occ_changed, int to) {
+    assert(cache->num_frames < ATTACK_CACHE_PLIES);
+    AttackFrame *frame = &cache->frames[cache->num_frames++];
+    frame->occ_changed = occ_changed;
+    frame->to = to;
+    frame->first_saved = cache->num_saved;
+    cache->pending = 1;
+}
+
+// Puts back the entries sync_attacks overwrote for the last move, or drops
+// its update if no reader applied it
+static void pop_attack_frame(AttackCache *cache) {
+    AttackFrame *frame = &cache->frames[--cache->num_frames];
+    if (cache->pending) {
+        cache->pending = 0;
+        return;
+    }
+    for (int i = frame->first_saved; i < cache->num_saved; i++) {
+        cache->attacks[cache->saved_sq[i]] = cache->saved_old[i];
+    }
+    cache->num_saved = frame->first_saved;
+}
+
+#define ON(a, b, sq)                                 \
+    (board->bitboards[(a) + (b)] |= (1ULL << (sq))); \
+    (board->hash ^= zobrist.piece[b][a / 2][sq]);    \
+    (board->mg[b] += mg_table[b][a / 2][sq])
+#define OFF(a, b, sq)                                 \
+    (board->bitboards[(a) + (b)] &= ~(1ULL << (sq))); \
+    (board->hash ^= zobrist.piece[b][a / 2][sq]);     \
+    (board->mg[b] -= mg_table[b][a / 2][sq])
 
 #define ON_NO_HASH(piece, side, sq) \
-    (board.bitboards[(piece) + (side)] |= (1ULL << (sq)))
+    (board->bitboards[(piece) + (side)] |= (1ULL << (sq)))
 #define OFF_NO_HASH(piece, side, sq) \
-    (board.bitboards[(piece) + (side)] &= ~(1ULL << (sq)))
+    (board->bitboards[(piece) + (side)] &= ~(1ULL << (sq)))
 
-ChessBoard make_move(ChessBoard board, u64 move) {
+void do_move(ChessBoard *board, Move move, Undo *undo) {
     int from, to;
     Piece piece, captured;
-    MoveType move_type;
+    MoveType type;
     Piece promotion_piece;
 
     from = move & 0x3f;
     to = (move >> 6) & 0x3f;
-    piece = (move >> 12) & 0xf;
-    captured = (move >> 16) & 0xf;
-    move_type = (move >> 20) & 0xf;
-    promotion_piece = (move >> 24) & 0xf;
+    piece = board->mailbox[from];
+    captured = board->mailbox[to];  // empty for en passant
+    type = move_type(move);
+    promotion_piece = promote_type(move);
+
+    // only one move's attack update can be pending
+    sync_attacks(board);
+    u64 occ = board->bitboards[all_pieces + all];
+
+    // Save irreversible state
+    undo->captured = captured;
+    undo->KC[white] = board->KC[white];
+    undo->KC[black] = board->KC[black];
+    undo->QC[white] = board->QC[white];
+    undo->QC[black] = board->QC[black];
+    undo->ep = board->ep;
+    undo->halfmove_clock = board->halfmove_clock;
+    undo->hash = board->hash;
+    undo->mg[white] = board->mg[white];
+    undo->mg[black] = board->mg[black];
 
     // Board Updates
-    ON(piece, board.side, to);
-    OFF(piece, board.side, from);
+    ON(piece, board->side, to);
+    OFF(piece, board->side, from);
+    board->mailbox[to] = piece;
+    board->mailbox[from] = empty;
 
-    ON_NO_HASH(all_pieces, board.side, to);
-    OFF_NO_HASH(all_pieces, board.side, from);
+    ON_NO_HASH(all_pieces, board->side, to);
+    OFF_NO_HASH(all_pieces, board->side, from);
 
     ON_NO_HASH(all_pieces, all, to);
     OFF_NO_HASH(all_pieces, all, from);
 
     // Conditional stuff
-    switch (move_type) {
+    switch (type) {
         int dir;
 
         case NORMAL:
             // Update board
             if (captured != empty) {
-                OFF(captured, !board.side, to);
-                OFF_NO_HASH(all_pieces, !board.side, to);
+                OFF(captured, !board->side, to);
+                OFF_NO_HASH(all_pieces, !board->side, to);
             }
             break;
 
         case EN_PASSANT:
-            dir = 8 * (board.side - !board.side);
-            OFF(pawn, !board.side, to + dir);
-            OFF_NO_HASH(all_pieces, !board.side, to + dir);
+            dir = 8 * (board->side - !board->side);
+            OFF(pawn, !board->side, to + dir);
+            OFF_NO_HASH(all_pieces, !board->side, to + dir);
             OFF_NO_HASH(all_pieces, all, to + dir);
+            board->mailbox[to + dir] = empty;
             break;
 
         case PROMOTION:
-            OFF(piece, board.side, to);
-            ON(promotion_piece, board.side, to);
+            OFF(piece, board->side, to);
+            ON(promotion_piece, board->side, to);
+            board->mailbox[to] = promotion_piece;
 
             if (captured != empty) {
-                OFF(captured, !board.side, to);
-                OFF_NO_HASH(all_pieces, !board.side, to);
+                OFF(captured, !board->side, to);
+                OFF_NO_HASH(all_pieces, !board->side, to);
             }
             break;
 
         case CASTLE_KING:
-            OFF(rook, board.side, from - 3);
-            ON(rook, board.side, to + 1);
+            OFF(rook, board->side, from - 3);
+            ON(rook, board->side, to + 1);
 
-            OFF_NO_HASH(all_pieces, board.side, from - 3);
-            ON_NO_HASH(all_pieces, board.side, to + 1);
+            OFF_NO_HASH(all_pieces, board->side, from - 3);
+            ON_NO_HASH(all_pieces, board->side, to + 1);
 
             OFF_NO_HASH(all_pieces, all, from - 3);
             ON_NO_HASH(all_pieces, all, to + 1);
+
+            board->mailbox[from - 3] = empty;
+            board->mailbox[to + 1] = rook;
             break;
 
         case CASTLE_QUEEN:
-            OFF(rook, board.side, from + 4);
-            ON(rook, board.side, to - 1);
+            OFF(rook, board->side, from + 4);
+            ON(rook, board->side, to - 1);
 
-            OFF_NO_HASH(all_pieces, board.side, from + 4);
-            ON_NO_HASH(all_pieces, board.side, to - 1);
+            OFF_NO_HASH(all_pieces, board->side, from + 4);
+            ON_NO_HASH(all_pieces, board->side, to - 1);
 
             OFF_NO_HASH(all_pieces, all, from + 4);
             ON_NO_HASH(all_pieces, all, to - 1);
+
+            board->mailbox[from + 4] = empty;
+            board->mailbox[to - 1] = rook;
             break;
 
         case UNKNOWN:
@@ -164,32 +278,156 @@ ChessBoard make_move(ChessBoard board, u64 move) {
             break;
     }
 
+    // Attack cache, updated by the next reader
+    if (board->cache) {
+        push_attack_frame(board->cache,
+                          occ ^ board->bitboards[all_pieces + all], to);
+    }
+
     // Castling
-    update_castling_rights(&board, move);
+    update_castling_rights(board, from, to, piece, captured);
 
     // En Passant
-    board.hash ^= board.ep != -1 ? zobrist.ep[board.ep] : 0;
-    board.ep = -1;
+    board->hash ^= board->ep != -1 ? zobrist.ep[board->ep] : 0;
+    board->ep = -1;
     if (piece == pawn && abs(from - to) == 16) {
-        board.ep = (from + to) / 2;
-        board.hash ^= zobrist.ep[(from + to) / 2];
+        board->ep = (from + to) / 2;
+        board->hash ^= zobrist.ep[(from + to) / 2];
     }
 
     // Halfmove Clock
-    board.halfmove_clock++;
+    board->halfmove_clock++;
     if (piece == pawn || captured != empty) {
-        board.halfmove_clock = 0;
+        board->halfmove_clock = 0;
     }
 
     // Fullmove Number
-    if (board.side == black) {
-        board.fullmove_number++;
+    if (board->side == black) {
+        board->fullmove_number++;
     }
 
     // Side
-    board.side = !board.side;
-    board.hash ^= zobrist.side;
+    board->side = !board->side;
+    board->hash ^= zobrist.side;
+}
+
+// Reverses do_move: bitboards are moved back by hand, everything else is
+// restored from the undo record
+void undo_move(ChessBoard *board, Move move, Undo *undo) {
+    int from, to;
+    Piece piece, captured;
+    MoveType type;
+    Piece promotion_piece;
+
+    from = move & 0x3f;
+    to = (move >> 6) & 0x3f;
+    type = move_type(move);
+    promotion_piece = promote_type(move);
+    piece = type == PROMOTION ? pawn : board->mailbox[to];
+    captured = undo->captured;
+
+    // Side
+    board->side = !board->side;
+
+    // Fullmove Number
+    if (board->side == black) {
+        board->fullmove_number--;
+    }
+
+    // Board Updates
+    if (type == PROMOTION) {
+        OFF_NO_HASH(promotion_piece, board->side, to);
+    } else {
+        OFF_NO_HASH(piece, board->side, to);
+    }
+    ON_NO_HASH(piece, board->side, from);
+
+    OFF_NO_HASH(all_pieces, board->side, to);
+    ON_NO_HASH(all_pieces, board->side, from);
 
+    OFF_NO_HASH(all_pieces, all, to);
+    ON_NO_HASH(all_pieces, all, from);
+
+    board->mailbox[from] = piece;
+    board->mailbox[to] = captured;
+
+    switch (type) {
+        int dir;
+
+        case NORMAL:
+        case PROMOTION:
+            if (captured != empty) {
+                ON_NO_HASH(captured, !board->side, to);
+                ON_NO_HASH(all_pieces, !board->side, to);
+                ON_NO_HASH(all_pieces, all, to);
+            }
+            break;
+
+        case EN_PASSANT:
+            dir = 8 * (board->side - !board->side);
+            ON_NO_HASH(pawn, !board->side, to + dir);
+            ON_NO_HASH(all_pieces, !board->side, to + dir);
+            ON_NO_HASH(all_pieces, all, to + dir);
+            board->mailbox[to] = empty;
+            board->mailbox[to + dir] = pawn;
+            break;
+
+        case CASTLE_KING:
+            OFF_NO_HASH(rook, board->side, to + 1);
+            ON_NO_HASH(rook, board->side, from - 3);
+
+            OFF_NO_HASH(all_pieces, board->side, to + 1);
+            ON_NO_HASH(all_pieces, board->side, from - 3);
+
+            OFF_NO_HASH(all_pieces, all, to + 1);
+            ON_NO_HASH(all_pieces, all, from - 3);
+
+            board->mailbox[to + 1] = empty;
+            board->mailbox[from - 3] = rook;
+            break;
+
+        case CASTLE_QUEEN:
+            OFF_NO_HASH(rook, board->side, to - 1);
+            ON_NO_HASH(rook, board->side, from + 4);
+
+            OFF_NO_HASH(all_pieces, board->side, to - 1);
+            ON_NO_HASH(all_pieces, board->side, from + 4);
+
+            OFF_NO_HASH(all_pieces, all, to - 1);
+            ON_NO_HASH(all_pieces, all, from + 4);
+
+            board->mailbox[to - 1] = empty;
+            board->mailbox[from + 4] = rook;
+            break;
+
+        default:
+            fprintf(stderr, "[%s (%s:%d)] Error: unknown move type\n", __func__,
+                    __FILE__, __LINE__);
+            exit(1);
+            break;
+    }
+
+    // Attack cache: nothing to take back if the update never ran
+    if (board->cache) pop_attack_frame(board->cache);
+
+    // Irreversible state
+    board->KC[white] = undo->KC[white];
+    board->KC[black] = undo->KC[black];
+    board->QC[white] = undo->QC[white];
+    board->QC[black] = undo->QC[black];
+    board->ep = undo->ep;
+    board->halfmove_clock = undo->halfmove_clock;
+    board->hash = undo->hash;
+    board->mg[white] = undo->mg[white];
+    board->mg[black] = undo->mg[black];
+}
+
+// Copy-make wrapper around do_move. The copy has no attack cache, the
+// cache stays with the original.
+ChessBoard make_move(ChessBoard board, Move move) {
+    Undo undo;
+    board.cache = NULL;
+    do_move(&board, move, &undo);
     return board;
 }
 
@@ -208,27 +446,31 @@ int zugzwang(ChessBoard *board, u64 attack_mask) {
     return pieces == 0;
 }
 
-ChessBoard null_move(ChessBoard board) {
-    board.side = !board.side;
-    board.hash ^= zobrist.side;
+void do_null_move(ChessBoard *board, Undo *undo) {
+    undo->ep = board->ep;
+    undo->hash = board->hash;
+    undo->halfmove_clock = board->halfmove_clock;
 
-    // reset ep
-    board.hash ^= board.ep != -1 ? zobrist.ep[board.ep] : 0;
-    board.ep = -1;
+    // nothing before a null move can repeat in a real game
+    board->halfmove_clock = 0;
 
-    return board;
+    board->side = !board->side;
+    board->hash ^= zobrist.side;
+
+    // reset ep
+    board->hash ^= board->ep != -1 ? zobrist.ep[board->ep] : 0;
+    board->ep = -1;
 }
 
-u64 select_move(u64 *moves, int num_moves) {
-    int ind = 0, best_score = 0;
-    for (int i = 0; i < num_moves; i++) {
-        if (move_value(moves[i]) > best_score) {
-            best_score = move_value(moves[i]);
-            ind = i;
-        }
-    }
+void undo_null_move(ChessBoard *board, Undo *undo) {
+    board->side = !board->side;
+    board->ep = undo->ep;
+    board->hash = undo->hash;
+    board->halfmove_clock = undo->halfmove_clock;
+}
 
-    u64 best = moves[ind];
-    moves[ind] = moves[num_moves - 1];
-    return best_score != 0 ? best : 0;
+ChessBoard null_move(ChessBoard board) {
+    Undo undo;
+    do_null_move(&board, &undo);
+    return board;
 }
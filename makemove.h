@@ -3,31 +3,69 @@
 
 #include "board.h"
 
-ChessBoard make_move(ChessBoard board, u64 move);
+// Undo record: the state do_move can't recover from the move itself
+typedef struct Undo {
+    Piece captured;
+    int KC[2], QC[2];
+    int ep;
+    int halfmove_clock;
+    u64 hash;
+    int mg[2];
+} Undo;
+
+// Attack cache: squares attacked by the piece on each square (0 if empty),
+// so that attackers() and move generation need no slider lookups. It sits
+// in the search thread, not the board, so boards and undo records stay
+// small; do_move and undo_move keep it up to date for the attached board.
+#define ATTACK_CACHE_PLIES 256
+
+// A move made since attaching: the squares it emptied or filled, its
+// destination, and where the entries it overwrote start in saved_sq/old
+typedef struct {
+    u64 occ_changed;
+    int to;
+    int first_saved;
+} AttackFrame;
+
+typedef struct AttackCache {
+    u64 attacks[64];
+    // the last frame is pending until a reader applies it, see sync_attacks
+    AttackFrame frames[ATTACK_CACHE_PLIES];
+    int num_frames;
+    int pending;
+    // one entry per piece at most plus the emptied squares, per frame
+    u8 saved_sq[ATTACK_CACHE_PLIES * 36];
+    u64 saved_old[ATTACK_CACHE_PLIES * 36];
+    int num_saved;
+} AttackCache;
+
+// make/unmake in place
+void do_move(ChessBoard *board, Move move, Undo *undo);
+void undo_move(ChessBoard *board, Move move, Undo *undo);
+void do_null_move(ChessBoard *board, Undo *undo);
+void undo_null_move(ChessBoard *board, Undo *undo);
+void attach_attack_cache(ChessBoard *board, AttackCache *cache);
+void sync_attacks(ChessBoard *board);
+
+// copy-make
+ChessBoard make_move(ChessBoard board, Move move);
 ChessBoard null_move(ChessBoard board);
 int zugzwang(ChessBoard *board, u64 attack_mask);
 
-// Move selection TODO
-u64 select_move(u64 *moves, int num_moves);
-
 // Move representation
-// moves are packed into a u64 (LSB -> MSB)
+// moves are packed into a u16 (LSB -> MSB)
 // 0-5: from square
 // 6-11: to square
-// 12-15: piece
-// 16-19: capture piece
-// 20-23: move type
-// 24-27: promote type
-
-// unimportant below
-// 28-43: score
+// 12-15: move type, promotions use PROMOTION + the index of the piece
 
 // move utilities
-int from(u64 move);
-int to(u64 move);
-int piece(u64 move);
-int captured(u64 move);
-int move_type(u64 move);
-int promote_type(u64 move);
+int from(Move move);
+int to(Move move);
+int move_type(Move move);
+int promote_type(Move move);
+
+// pieces read off the board, which must be the one the move is made from
+Piece moved_piece(ChessBoard *board, Move move);
+Piece captured_piece(ChessBoard *board, Move move);
 
 #endif  // MAKEMOVE_H
@@ -5,6 +5,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAS_PEXT
+#include <immintrin.h>
+#endif
+
 #include "board.h"
 #include "common.h"
 #include "eval.h"
@@ -13,15 +17,15 @@
 #include "search.h"
 
 // Utilities
-u64 move_from_uci(ChessBoard *board, char *uci) {
-    int from, to, piece, captured, promote_type = 0;
+Move move_from_uci(ChessBoard *board, char *uci) {
+    int from, to, piece, captured;
     MoveType move_type = UNKNOWN;
 
     from = 7 - (uci[0] - 'a') + 8 * (uci[1] - '1');
     to = 7 - (uci[2] - 'a') + 8 * (uci[3] - '1');
 
     piece = ChessBoard_piece_at(board, from);
-    captured = ChessBoard_piece_at(board, to);
+    captured = board->mailbox[to];
 
     if (piece == empty) {
         fprintf(stderr, "Error: No piece at %s [%s(%s):%d]\n", uci, __FILE__,
@@ -44,42 +48,34 @@ u64 move_from_uci(ChessBoard *board, char *uci) {
         char promo = uci[4];
         switch (promo) {
             case 'q':
-                promote_type = queen;
+                move_type = PROMOTION + queen / 2 - 1;
                 break;
             case 'r':
-                promote_type = rook;
+                move_type = PROMOTION + rook / 2 - 1;
                 break;
             case 'b':
-                promote_type = bishop;
+                move_type = PROMOTION + bishop / 2 - 1;
                 break;
             case 'n':
-                promote_type = knight;
+                move_type = PROMOTION + knight / 2 - 1;
                 break;
             default:
                 fprintf(stderr, "Error: Invalid promotion %c [%s(%s):%d]\n",
                         promo, __FILE__, __func__, __LINE__);
                 exit(1);
         }
-        move_type = PROMOTION;
     } else {
         move_type = NORMAL;
     }
 
-    return from | to << 6 | piece << 12 | captured << 16 | move_type << 20 |
-           promote_type << 24;
+    return MOVE(from, to, move_type);
 }
 
 // uci must have length 4+1 (or more)
-void move_to_uci(u64 move, char *uci) {
-    int from, to;
-    MoveType type;
-    Piece p;
-    from = move & 0x3f;
-    to = (move >> 6) & 0x3f;
-    type = (move >> 20) & 0xf;
-    if (type == PROMOTION) {
-        p = (move >> 24) & 0xf;
-        switch (p) {
+void move_to_uci(Move move, char *uci) {
+    int from_sq = from(move), to_sq = to(move);
+    if (move_type(move) == PROMOTION) {
+        switch (promote_type(move)) {
             case queen:
                 uci[4] = 'q';
                 break;
@@ -103,20 +99,27 @@ void move_to_uci(u64 move, char *uci) {
         uci[4] = '\0';
     }
 
-    uci[0] = 'a' + 7 - (from % 8);
-    uci[1] = '1' + (from / 8);
-    uci[2] = 'a' + 7 - (to % 8);
-    uci[3] = '1' + (to / 8);
+    uci[0] = 'a' + 7 - (from_sq % 8);
+    uci[1] = '1' + (from_sq / 8);
+    uci[2] = 'a' + 7 - (to_sq % 8);
+    uci[3] = '1' + (to_sq / 8);
 }
 
+// Side specialization: the *_side generators take the side as a parameter
+// and are always inlined into one caller per side, so the side is a
+// compile-time constant there and every side test, shift and rank mask
+// folds to an immediate. The public functions dispatch on the side once.
+#define SIDE_INLINE static inline __attribute__((always_inline))
+
 // Pawn generation
-u64 get_pawn_moves(ChessBoard *board, PawnMoveType move_type) {
+SIDE_INLINE u64 get_pawn_moves_side(ChessBoard *board,
+                                    PawnMoveType move_type, Side side) {
     u64 pawns, moved_pawns, mask, sq;
     int wtm;
 
     moved_pawns = 0;
-    wtm = board->side == white;
-    pawns = board->bitboards[board->side + pawn];
+    wtm = side == white;
+    pawns = board->bitboards[side + pawn];
 
     switch (move_type) {
         case SINGLE_PUSH:
@@ -143,7 +146,7 @@ u64 get_pawn_moves(ChessBoard *board, PawnMoveType move_type) {
             moved_pawns = pawns & ~mask;
             moved_pawns = moved_pawns & ~FILE_1;
             moved_pawns = wtm ? moved_pawns << 9 : moved_pawns >> 7;
-            moved_pawns &= board->bitboards[all_pieces + !board->side];
+            moved_pawns &= board->bitboards[all_pieces + !side];
             break;
 
         case CAPTURE_RIGHT:
@@ -151,7 +154,7 @@ u64 get_pawn_moves(ChessBoard *board, PawnMoveType move_type) {
             moved_pawns = pawns & ~mask;
             moved_pawns = moved_pawns & ~FILE_8;
             moved_pawns = wtm ? moved_pawns << 7 : moved_pawns >> 9;
-            moved_pawns &= board->bitboards[all_pieces + !board->side];
+            moved_pawns &= board->bitboards[all_pieces + !side];
             break;
 
         case PAWN_PROMOTION:
@@ -166,7 +169,7 @@ u64 get_pawn_moves(ChessBoard *board, PawnMoveType move_type) {
             moved_pawns = pawns & mask;
             moved_pawns = moved_pawns & ~FILE_1;
             moved_pawns = wtm ? moved_pawns << 9 : moved_pawns >> 7;
-            moved_pawns &= board->bitboards[all_pieces + !board->side];
+            moved_pawns &= board->bitboards[all_pieces + !side];
             break;
 
         case PROMOTION_CAPTURE_RIGHT:
@@ -174,7 +177,7 @@ u64 get_pawn_moves(ChessBoard *board, PawnMoveType move_type) {
             moved_pawns = pawns & mask;
             moved_pawns = moved_pawns & ~FILE_8;
             moved_pawns = wtm ? moved_pawns << 7 : moved_pawns >> 9;
-            moved_pawns &= board->bitboards[all_pieces + !board->side];
+            moved_pawns &= board->bitboards[all_pieces + !side];
             break;
 
         case EN_PASSANT_LEFT:
@@ -207,11 +210,18 @@ u64 get_pawn_moves(ChessBoard *board, PawnMoveType move_type) {
     return moved_pawns;
 }
 
-int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
-                       u64 pawn_moves, PawnMoveType move_type) {
-    int to, from, captured;
+u64 get_pawn_moves(ChessBoard *board, PawnMoveType move_type) {
+    return board->side == white
+               ? get_pawn_moves_side(board, move_type, white)
+               : get_pawn_moves_side(board, move_type, black);
+}
+
+SIDE_INLINE int extract_pawn_moves_side(ExtMove *moves, int move_p,
+                                        u64 pawn_moves, PawnMoveType move_type,
+                                        Side side) {
+    int to, from;
     int num_moves = 0;
-    int wtm = board->side == white;
+    int wtm = side == white;
 
     switch (move_type) {
         case SINGLE_PUSH:
@@ -219,8 +229,7 @@ int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
                 int ind = __builtin_ctzll(pawn_moves);
                 to = ind;
                 from = wtm ? ind - 8 : ind + 8;
-                moves[move_p + num_moves] =
-                    from | to << 6 | pawn << 12 | empty << 16 | NORMAL << 20;
+                moves[move_p + num_moves].move = MOVE(from, to, NORMAL);
                 num_moves++;
                 BB_CLEAR(pawn_moves, ind);
             }
@@ -231,8 +240,7 @@ int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
                 int ind = __builtin_ctzll(pawn_moves);
                 to = ind;
                 from = wtm ? ind - 16 : ind + 16;
-                moves[move_p + num_moves] =
-                    from | to << 6 | pawn << 12 | empty << 16 | NORMAL << 20;
+                moves[move_p + num_moves].move = MOVE(from, to, NORMAL);
                 num_moves++;
                 BB_CLEAR(pawn_moves, ind);
             }
@@ -243,9 +251,7 @@ int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
                 int ind = __builtin_ctzll(pawn_moves);
                 to = ind;
                 from = wtm ? ind - 9 : ind + 7;
-                captured = ChessBoard_piece_at(board, to);
-                moves[move_p + num_moves] =
-                    from | to << 6 | pawn << 12 | captured << 16 | NORMAL << 20;
+                moves[move_p + num_moves].move = MOVE(from, to, NORMAL);
                 num_moves++;
                 BB_CLEAR(pawn_moves, ind);
             }
@@ -256,9 +262,7 @@ int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
                 int ind = __builtin_ctzll(pawn_moves);
                 to = ind;
                 from = wtm ? ind - 7 : ind + 9;
-                captured = ChessBoard_piece_at(board, to);
-                moves[move_p + num_moves] =
-                    from | to << 6 | pawn << 12 | captured << 16 | NORMAL << 20;
+                moves[move_p + num_moves].move = MOVE(from, to, NORMAL);
                 num_moves++;
                 BB_CLEAR(pawn_moves, ind);
             }
@@ -272,9 +276,8 @@ int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
 
                 int promote[4] = {queen, rook, bishop, knight};
                 for (int i = 0; i < 4; i++) {
-                    moves[move_p + num_moves] = from | to << 6 | pawn << 12 |
-                                                empty << 16 | PROMOTION << 20 |
-                                                promote[i] << 24;
+                    moves[move_p + num_moves].move =
+                        PROMOTION_MOVE(from, to, promote[i]);
                     num_moves++;
                 }
                 BB_CLEAR(pawn_moves, ind);
@@ -286,13 +289,11 @@ int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
                 int ind = __builtin_ctzll(pawn_moves);
                 to = ind;
                 from = wtm ? ind - 9 : ind + 7;
-                captured = ChessBoard_piece_at(board, to);
 
                 int promote[4] = {queen, rook, bishop, knight};
                 for (int i = 0; i < 4; i++) {
-                    moves[move_p + num_moves] =
-                        from | to << 6 | pawn << 12 | captured << 16 |
-                        PROMOTION << 20 | promote[i] << 24;
+                    moves[move_p + num_moves].move =
+                        PROMOTION_MOVE(from, to, promote[i]);
                     num_moves++;
                 }
                 BB_CLEAR(pawn_moves, ind);
@@ -304,13 +305,11 @@ int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
                 int ind = __builtin_ctzll(pawn_moves);
                 to = ind;
                 from = wtm ? ind - 7 : ind + 9;
-                captured = ChessBoard_piece_at(board, to);
 
                 int promote[4] = {queen, rook, bishop, knight};
                 for (int i = 0; i < 4; i++) {
-                    moves[move_p + num_moves] =
-                        from | to << 6 | pawn << 12 | captured << 16 |
-                        PROMOTION << 20 | promote[i] << 24;
+                    moves[move_p + num_moves].move =
+                        PROMOTION_MOVE(from, to, promote[i]);
                     num_moves++;
                 }
                 BB_CLEAR(pawn_moves, ind);
@@ -324,8 +323,7 @@ int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
             to = ind;
             from = wtm ? ind - 9 : ind + 7;
 
-            moves[move_p + num_moves] =
-                from | to << 6 | pawn << 12 | pawn << 16 | EN_PASSANT << 20;
+            moves[move_p + num_moves].move = MOVE(from, to, EN_PASSANT);
             num_moves++;
             break;
 
@@ -335,8 +333,7 @@ int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
             to = ind;
             from = wtm ? ind - 7 : ind + 9;
 
-            moves[move_p + num_moves] =
-                from | to << 6 | pawn << 12 | pawn << 16 | EN_PASSANT << 20;
+            moves[move_p + num_moves].move = MOVE(from, to, EN_PASSANT);
             num_moves++;
             break;
     }
@@ -344,34 +341,63 @@ int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
     return num_moves;
 }
 
+int extract_pawn_moves(ChessBoard *board, ExtMove *moves, int move_p,
+                       u64 pawn_moves, PawnMoveType move_type) {
+    return board->side == white
+               ? extract_pawn_moves_side(moves, move_p, pawn_moves, move_type,
+                                         white)
+               : extract_pawn_moves_side(moves, move_p, pawn_moves, move_type,
+                                         black);
+}
+
 // Non-pawn move extraction
-inline u64 get_attacks(ChessBoard *board, int sq, Piece p) {
+#ifdef HAS_PEXT
+// Compiled for BMI2 whatever the build flags, only called when
+// lookup.use_pext is set. Inlined when building with -mbmi2 or -march.
+__attribute__((target("bmi2"))) u64 get_pext_attacks(u64 occ, int sq,
+                                                     Piece p) {
+    if (p == rook) {
+        return lookup.rook_pext[lookup.rook_offset[sq] +
+                                _pext_u64(occ, lookup.rook_mask[sq])];
+    }
+    return lookup.bishop_pext[lookup.bishop_offset[sq] +
+                              _pext_u64(occ, lookup.bishop_mask[sq])];
+}
+#endif
+
+// attacks from sq given the occupancy occ
+inline u64 get_attacks_occ(u64 occ, int sq, Piece p) {
     u64 pieces, mask, magic, moves;
     int ind, shift_amt;
 
-    pieces = board->bitboards[all_pieces + all];
+#ifdef HAS_PEXT
+    if (lookup.use_pext && (p == rook || p == bishop))
+        return get_pext_attacks(occ, sq, p);
+#endif
+
+    pieces = occ;
     switch (p) {
         case rook:
             mask = lookup.rook_mask[sq];
             magic = lookup.rook_magic[sq];
-            shift_amt = 64 - 12;
+            shift_amt = lookup.rook_shift[sq];
 
             ind = ((pieces & mask) * magic) >> shift_amt;
-            moves = lookup.rook_move[4096 * sq + ind];
+            moves = lookup.rook_move[lookup.rook_offset[sq] + ind];
             break;
 
         case bishop:
             mask = lookup.bishop_mask[sq];
             magic = lookup.bishop_magic[sq];
-            shift_amt = 64 - 9;
+            shift_amt = lookup.bishop_shift[sq];
 
             ind = ((pieces & mask) * magic) >> shift_amt;
-            moves = lookup.bishop_move[512 * sq + ind];
+            moves = lookup.bishop_move[lookup.bishop_offset[sq] + ind];
             break;
 
         case queen:
-            moves =
-                get_attacks(board, sq, rook) | get_attacks(board, sq, bishop);
+            moves = get_attacks_occ(occ, sq, rook) |
+                    get_attacks_occ(occ, sq, bishop);
             break;
 
         case knight:
@@ -391,31 +417,30 @@ inline u64 get_attacks(ChessBoard *board, int sq, Piece p) {
     return moves;
 }
 
+inline u64 get_attacks(ChessBoard *board, int sq, Piece p) {
+    return get_attacks_occ(board->bitboards[all_pieces + all], sq, p);
+}
+
 u64 get_moves(ChessBoard *board, int sq, Piece p) {
     u64 friendlies = board->bitboards[all_pieces + board->side];
     return get_attacks(board, sq, p) & ~friendlies;
 }
 
-int extract_moves(ChessBoard *board, u64 *moves, int move_p, u64 move_bb,
-                  int sq, Piece p, int quiet) {
-    int to, captured;
+int extract_moves(ExtMove *moves, int move_p, u64 move_bb, int sq) {
     int num_moves = 0;
 
     while (move_bb) {
-        int ind = __builtin_ctzll(move_bb);
-        to = ind;
-        captured = quiet ? empty : ChessBoard_piece_at(board, ind);
-        moves[move_p + num_moves] =
-            sq | to << 6 | p << 12 | captured << 16 | NORMAL << 20;
+        int to = __builtin_ctzll(move_bb);
+        moves[move_p + num_moves].move = MOVE(sq, to, NORMAL);
         num_moves++;
-        BB_CLEAR(move_bb, ind);
+        BB_CLEAR(move_bb, to);
     }
 
     return num_moves;
 }
 
 // For debugging only
-int extract_all_moves(ChessBoard *board, u64 *moves, int move_p, Piece p) {
+int extract_all_moves(ChessBoard *board, ExtMove *moves, int move_p, Piece p) {
     int sq, num_moves;
     u64 bb, move_bb, enemies;
 
@@ -427,10 +452,10 @@ int extract_all_moves(ChessBoard *board, u64 *moves, int move_p, Piece p) {
         sq = __builtin_ctzll(bb);
         move_bb = get_moves(board, sq, p);
 
-        num_moves += extract_moves(board, moves, move_p + num_moves,
-                                   move_bb & enemies, sq, p, 0);
-        num_moves += extract_moves(board, moves, move_p + num_moves,
-                                   move_bb & ~enemies, sq, p, 1);
+        num_moves +=
+            extract_moves(moves, move_p + num_moves, move_bb & enemies, sq);
+        num_moves +=
+            extract_moves(moves, move_p + num_moves, move_bb & ~enemies, sq);
 
         BB_CLEAR(bb, sq);
     }
@@ -439,226 +464,385 @@ int extract_all_moves(ChessBoard *board, u64 *moves, int move_p, Piece p) {
 }
 
 // Castling
-// attacked is squares attacked by !board->side (enemies)
-int generate_castling(ChessBoard *board, u64 *moves, u64 attacked, int move_p) {
+// attacked is squares attacked by !side (enemies)
+SIDE_INLINE int generate_castling_side(ChessBoard *board, ExtMove *moves,
+                                       u64 attacked, int move_p, Side side) {
     int sq, king_to, num_moves = 0;
     u64 castle_mask, check_mask;
 
-    if (board->side == white) {
-        sq = __builtin_ctzll(board->bitboards[white + king]);
-
-        if (board->KC[white]) {
-            king_to = sq - 2;
-            castle_mask = BB_SQUARE(sq - 1) | BB_SQUARE(sq - 2);
-            check_mask = BB_SQUARE(sq) | BB_SQUARE(sq - 1) | BB_SQUARE(sq - 2);
-
-            if (!(castle_mask & board->bitboards[all_pieces + all]) &&
-                !(check_mask & attacked)) {
-                moves[move_p + num_moves] = sq | king_to << 6 | king << 12 |
-                                            empty << 16 | CASTLE_KING << 20;
-                num_moves++;
-            }
-        }
-
-        if (board->QC[white]) {
-            king_to = sq + 2;
-            castle_mask =
-                BB_SQUARE(sq + 1) | BB_SQUARE(sq + 2) | BB_SQUARE(sq + 3);
-            check_mask = BB_SQUARE(sq) | BB_SQUARE(sq + 1) | BB_SQUARE(sq + 2);
-
-            if (!(castle_mask & board->bitboards[all_pieces + all]) &&
-                !(check_mask & attacked)) {
-                moves[move_p + num_moves] = sq | king_to << 6 | king << 12 |
-                                            empty << 16 | CASTLE_QUEEN << 20;
-                num_moves++;
-            }
-        }
-    } else {
-        sq = __builtin_ctzll(board->bitboards[black + king]);
+    sq = __builtin_ctzll(board->bitboards[side + king]);
 
-        if (board->KC[black]) {
-            king_to = sq - 2;
-            castle_mask = BB_SQUARE(sq - 1) | BB_SQUARE(sq - 2);
-            check_mask = BB_SQUARE(sq) | BB_SQUARE(sq - 1) | BB_SQUARE(sq - 2);
+    if (board->KC[side]) {
+        king_to = sq - 2;
+        castle_mask = BB_SQUARE(sq - 1) | BB_SQUARE(sq - 2);
+        check_mask = BB_SQUARE(sq) | BB_SQUARE(sq - 1) | BB_SQUARE(sq - 2);
 
-            if (!(castle_mask & board->bitboards[all_pieces + all]) &&
-                !(check_mask & attacked)) {
-                moves[move_p + num_moves] = sq | king_to << 6 | king << 12 |
-                                            empty << 16 | CASTLE_KING << 20;
-                num_moves++;
-            }
+        if (!(castle_mask & board->bitboards[all_pieces + all]) &&
+            !(check_mask & attacked)) {
+            moves[move_p + num_moves].move = MOVE(sq, king_to, CASTLE_KING);
+            num_moves++;
         }
+    }
 
-        if (board->QC[black]) {
-            king_to = sq + 2;
-            castle_mask =
-                BB_SQUARE(sq + 1) | BB_SQUARE(sq + 2) | BB_SQUARE(sq + 3);
-            check_mask = BB_SQUARE(sq) | BB_SQUARE(sq + 1) | BB_SQUARE(sq + 2);
+    if (board->QC[side]) {
+        king_to = sq + 2;
+        castle_mask = BB_SQUARE(sq + 1) | BB_SQUARE(sq + 2) | BB_SQUARE(sq + 3);
+        check_mask = BB_SQUARE(sq) | BB_SQUARE(sq + 1) | BB_SQUARE(sq + 2);
 
-            if (!(castle_mask & board->bitboards[all_pieces + all]) &&
-                !(check_mask & attacked)) {
-                moves[move_p + num_moves] = sq | king_to << 6 | king << 12 |
-                                            empty << 16 | CASTLE_QUEEN << 20;
-                num_moves++;
-            }
+        if (!(castle_mask & board->bitboards[all_pieces + all]) &&
+            !(check_mask & attacked)) {
+            moves[move_p + num_moves].move = MOVE(sq, king_to, CASTLE_QUEEN);
+            num_moves++;
         }
     }
 
     return num_moves;
 }
 
+// attacked is squares attacked by !board->side (enemies)
+int generate_castling(ChessBoard *board, ExtMove *moves, u64 attacked,
+                      int move_p) {
+    return board->side == white
+               ? generate_castling_side(board, moves, attacked, move_p, white)
+               : generate_castling_side(board, moves, attacked, move_p, black);
+}
+
 // Attackers
-// side: if `black`, gets squares attacked by black pieces, likewise for white
-u64 attackers(ChessBoard *board, Side side) {
-    u64 attack = 0;
+// Squares attacked by the piece on sq against the current occupancy
+u64 piece_attacks(ChessBoard *board, int sq) {
+    Piece p = board->mailbox[sq];
+    if (p == empty) return 0;
+    if (p == pawn) {
+        Side side = BB_GET(board->bitboards[all_pieces + white], sq) ? white
+                                                                     : black;
+        return lookup.pawn_attack[side][sq];
+    }
+    return get_attacks(board, sq, p);
+}
 
-    // Pawns
-    u64 moved_pawns;
+// Squares attacked by piece p on sq, from the attack cache if the board has
+// one; sync_attacks must have run
+SIDE_INLINE u64 cached_attacks(ChessBoard *board, int sq, Piece p) {
+    return board->cache ? board->cache->attacks[sq] : get_attacks(board, sq, p);
+}
+
+SIDE_INLINE u64 pawn_attackers_side(ChessBoard *board, Side side) {
     const u64 pawns = board->bitboards[side + pawn];
+    u64 left = pawns & ~FILE_1, right = pawns & ~FILE_8;
 
-    // left
-    moved_pawns = pawns & ~FILE_1;
-    moved_pawns = side == white ? moved_pawns << 9 : moved_pawns >> 7;
-    attack |= moved_pawns;
+    return side == white ? left << 9 | right << 7 : left >> 7 | right >> 9;
+}
 
-    // right
-    moved_pawns = pawns & ~FILE_8;
-    moved_pawns = side == white ? moved_pawns << 7 : moved_pawns >> 9;
-    attack |= moved_pawns;
+// Pawns are cheaper to shift in bulk than to read one by one from the cache
+SIDE_INLINE u64 attackers_side(ChessBoard *board, Side side) {
+    u64 attack = pawn_attackers_side(board, side);
+    u64 bb = board->bitboards[all_pieces + side] & ~board->bitboards[side + pawn];
 
-    // EP
-    if (board->ep != -1) {
-        int sq;
+    while (bb) {
+        int ind = __builtin_ctzll(bb);
+        attack |= board->cache->attacks[ind];
+        BB_CLEAR(bb, ind);
+    }
 
-        // left
-        sq = side == white ? board->ep - 9 : board->ep + 7;
-        moved_pawns = pawns & BB_SQUARE(sq);
-        moved_pawns = side == white ? moved_pawns << 9 : moved_pawns >> 7;
-        attack |= moved_pawns;
+    return attack;
+}
 
-        // right
-        sq = side == white ? board->ep - 7 : board->ep + 9;
-        moved_pawns = pawns & BB_SQUARE(sq);
-        moved_pawns = side == white ? moved_pawns << 7 : moved_pawns >> 9;
-        attack |= moved_pawns;
+// side: if `black`, gets squares attacked by black pieces, likewise for white
+u64 attackers(ChessBoard *board, Side side) {
+    if (!board->cache) {
+        return attackers_occ(board, side, board->bitboards[all_pieces + all]);
     }
+    sync_attacks(board);
+    return side == white ? attackers_side(board, white)
+                         : attackers_side(board, black);
+}
 
-    // Other pieces
-    u64 bb;
+// As attackers, but computed from scratch with `occ` as the occupancy
+u64 attackers_occ(ChessBoard *board, Side side, u64 occ) {
+    u64 attack = side == white ? pawn_attackers_side(board, white)
+                               : pawn_attackers_side(board, black);
+    u64 bb = board->bitboards[all_pieces + side] & ~board->bitboards[side + pawn];
 
-    // rook
-    bb = board->bitboards[side + rook];
     while (bb) {
         int ind = __builtin_ctzll(bb);
-        attack |= get_attacks(board, ind, rook);
-
+        attack |= get_attacks_occ(occ, ind, board->mailbox[ind]);
         BB_CLEAR(bb, ind);
     }
 
-    bb = board->bitboards[side + bishop];
-    while (bb) {
-        int ind = __builtin_ctzll(bb);
-        attack |= get_attacks(board, ind, bishop);
+    return attack;
+}
 
-        BB_CLEAR(bb, ind);
-    }
+int is_legal(ChessBoard *board, u64 attacked, Side side) {
+    u64 king_bb = board->bitboards[side + king];
+    u64 king_attackers = attacked & king_bb;
 
-    bb = board->bitboards[side + queen];
-    while (bb) {
-        int ind = __builtin_ctzll(bb);
-        attack |= get_attacks(board, ind, queen);
+    return king_bb && king_attackers == 0;
+}
 
-        BB_CLEAR(bb, ind);
-    }
+// Static exchange evaluation
+// All pieces of either side attacking sq, with occ as the occupancy
+u64 attackers_to(ChessBoard *board, int sq, u64 occ) {
+    u64 *bb = board->bitboards;
+    u64 rooks = bb[white + rook] | bb[black + rook] | bb[white + queen] |
+                bb[black + queen];
+    u64 bishops = bb[white + bishop] | bb[black + bishop] |
+                  bb[white + queen] | bb[black + queen];
+
+    return (lookup.pawn_attack[white][sq] & bb[black + pawn]) |
+           (lookup.pawn_attack[black][sq] & bb[white + pawn]) |
+           (lookup.knight_move[sq] & (bb[white + knight] | bb[black + knight])) |
+           (lookup.king_move[sq] & (bb[white + king] | bb[black + king])) |
+           (get_attacks_occ(occ, sq, rook) & rooks) |
+           (get_attacks_occ(occ, sq, bishop) & bishops);
+}
 
-    bb = board->bitboards[side + knight];
-    while (bb) {
-        int ind = __builtin_ctzll(bb);
-        attack |= get_attacks(board, ind, knight);
+// Cheaper than testing attackers() against the king when only the answer
+// is needed
+int side_in_check(ChessBoard *board) {
+    u64 king_bb = board->bitboards[board->side + king];
+    if (!king_bb) return 0;
 
-        BB_CLEAR(bb, ind);
+    return (attackers_to(board, __builtin_ctzll(king_bb),
+                         board->bitboards[all_pieces + all]) &
+            board->bitboards[all_pieces + !board->side]) != 0;
+}
+
+// Material the side to move wins (or loses, if negative) by the exchange
+// `move` starts on its target square, with both sides recapturing with
+// their least valuable piece and free to stop at any point. Sliders behind
+// the pieces that take part join in as the line opens. Pins are ignored.
+int see(ChessBoard *board, Move move) {
+    const int value[6] = {100, 500, 320, 330, 900, 10000};
+    const Piece order[6] = {pawn, knight, bishop, rook, queen, king};
+    u64 *bb = board->bitboards;
+    u64 rooks = bb[white + rook] | bb[black + rook] | bb[white + queen] |
+                bb[black + queen];
+    u64 bishops = bb[white + bishop] | bb[black + bishop] |
+                  bb[white + queen] | bb[black + queen];
+    int gain[32], d = 0;
+    int sq = to(move);
+    Side side = board->side;
+    Piece attacker = moved_piece(board, move);
+    Piece victim = captured_piece(board, move);
+    u64 occ = bb[all_pieces + all] ^ BB_SQUARE(from(move));
+
+    gain[0] = victim == empty ? 0 : value[victim / 2];
+    if (move_type(move) == EN_PASSANT) {
+        occ ^= BB_SQUARE(side == white ? sq - 8 : sq + 8);
+    } else if (move_type(move) == PROMOTION) {
+        gain[0] += value[promote_type(move) / 2] - value[pawn / 2];
+        attacker = promote_type(move);
     }
 
-    bb = board->bitboards[side + king];
-    while (bb) {
-        int ind = __builtin_ctzll(bb);
-        attack |= get_attacks(board, ind, king);
+    u64 attack = attackers_to(board, sq, occ) & occ;
+    while (1) {
+        side = !side;
+        u64 ours = attack & bb[all_pieces + side];
+        if (!ours) break;
+
+        // least valuable attacker
+        Piece p = king;
+        u64 from_bb = 0;
+        for (int i = 0; i < 6; i++) {
+            from_bb = ours & bb[side + order[i]];
+            if (from_bb) {
+                p = order[i];
+                break;
+            }
+        }
 
-        BB_CLEAR(bb, ind);
+        // what side is up if it takes and the exchange stops there
+        d++;
+        gain[d] = value[attacker / 2] - gain[d - 1];
+
+        occ ^= from_bb & -from_bb;
+        if (p == pawn || p == bishop || p == queen)
+            attack |= get_attacks_occ(occ, sq, bishop) & bishops;
+        if (p == rook || p == queen)
+            attack |= get_attacks_occ(occ, sq, rook) & rooks;
+        attack &= occ;
+        attacker = p;
     }
 
-    return attack;
+    // each side takes only if that beats stopping
+    while (d) {
+        d--;
+        gain[d] = -(-gain[d] > gain[d + 1] ? -gain[d] : gain[d + 1]);
+    }
+    return gain[0];
 }
 
-int is_legal(ChessBoard *board, u64 attacked, Side side) {
+// Legality
+void init_movegen_info(ChessBoard *board, u64 attacked, MoveGenInfo *info) {
+    Side side = board->side;
+    u64 occ = board->bitboards[all_pieces + all];
+    u64 friendlies = board->bitboards[all_pieces + side];
+    u64 enemies = board->bitboards[all_pieces + !side];
+    u64 enemy_rooks =
+        board->bitboards[!side + rook] | board->bitboards[!side + queen];
+    u64 enemy_bishops =
+        board->bitboards[!side + bishop] | board->bitboards[!side + queen];
     u64 king_bb = board->bitboards[side + king];
-    u64 king_attackers = attacked & king_bb;
 
-    return king_bb && king_attackers == 0;
+    info->attacked = attacked;
+    info->king_danger = attacked;
+    info->checkers = 0;
+    info->pinned = 0;
+    info->evasion_mask = ~0ULL;
+    info->king_sq = 0;
+    if (!king_bb) return;  // only in hand-made test positions
+
+    int ksq = __builtin_ctzll(king_bb);
+    info->king_sq = ksq;
+
+    // Checkers
+    info->checkers =
+        (lookup.pawn_attack[side][ksq] & board->bitboards[!side + pawn]) |
+        (lookup.knight_move[ksq] & board->bitboards[!side + knight]) |
+        (get_attacks_occ(occ, ksq, rook) & enemy_rooks) |
+        (get_attacks_occ(occ, ksq, bishop) & enemy_bishops);
+
+    // Pins: enemy sliders that see the king through exactly one of ours
+    u64 snipers = (get_attacks_occ(enemies, ksq, rook) & enemy_rooks) |
+                  (get_attacks_occ(enemies, ksq, bishop) & enemy_bishops);
+    while (snipers) {
+        int sq = __builtin_ctzll(snipers);
+        u64 blockers = lookup.between[ksq][sq] & occ;
+        if (blockers && !(blockers & (blockers - 1))) {
+            info->pinned |= blockers & friendlies;
+        }
+        BB_CLEAR(snipers, sq);
+    }
+
+    if (!info->checkers) return;
+
+    // Evasions: capture or block a single checker, only the king can move
+    // out of a double check
+    if (info->checkers & (info->checkers - 1)) {
+        info->evasion_mask = 0;
+    } else {
+        int checker = __builtin_ctzll(info->checkers);
+        info->evasion_mask = info->checkers | lookup.between[ksq][checker];
+    }
+
+    // Sliders see through the king, so the squares behind it are unsafe too
+    info->king_danger = attackers_occ(board, !side, occ & ~king_bb);
 }
 
-// Move generation
-int generate_promotions(ChessBoard *board, u64 *moves) {
-    u64 pawn_moves;
-    int num_moves = 0;
+int legal_pawn_move(ChessBoard *board, MoveGenInfo *info, Move move) {
+    int from_sq = from(move), to_sq = to(move);
+
+    // En passant removes two pieces from the rank the pawns are on, which
+    // the pin test can't see, so just try it
+    if (move_type(move) == EN_PASSANT) {
+        Undo undo;
+        do_move(board, move, &undo);
+        int legal =
+            is_legal(board, attackers(board, board->side), !board->side);
+        undo_move(board, move, &undo);
+        return legal;
+    }
 
-    PawnMoveType promotion_types[] = {PAWN_PROMOTION, PROMOTION_CAPTURE_LEFT,
-                                      PROMOTION_CAPTURE_RIGHT};
-    int len = sizeof(promotion_types) / sizeof(promotion_types[0]);
+    if (!(BB_SQUARE(to_sq) & info->evasion_mask)) return 0;
+    if ((BB_SQUARE(from_sq) & info->pinned) &&
+        !(BB_SQUARE(to_sq) & lookup.line[info->king_sq][from_sq]))
+        return 0;
 
-    for (int i = 0; i < len; i++) {
-        pawn_moves = get_pawn_moves(board, promotion_types[i]);
-        num_moves += extract_pawn_moves(board, moves, num_moves, pawn_moves,
-                                        promotion_types[i]);
+    return 1;
+}
+
+// Pawn moves are generated in bulk by shifting, so pins and evasions are
+// applied per move afterwards
+int filter_pawn_moves(ChessBoard *board, MoveGenInfo *info, ExtMove *moves,
+                      int num_moves) {
+    if (!(info->pinned | info->checkers) && board->ep == -1) return num_moves;
+
+    int legal_moves = 0;
+    for (int i = 0; i < num_moves; i++) {
+        if (legal_pawn_move(board, info, moves[i].move)) {
+            moves[legal_moves++] = moves[i];
+        }
     }
 
-    return num_moves;
+    return legal_moves;
 }
 
-int generate_normal_moves_pawn(ChessBoard *board, u64 *moves, int quiet) {
-    u64 pawn_moves;
+// Move generation
+// Pawn moves of one kind: generate the targets and extract the moves
+#define PAWN_MOVES(type)                                           \
+    (num_moves += extract_pawn_moves_side(                         \
+         moves, num_moves, get_pawn_moves_side(board, type, side), \
+         type, side))
+
+SIDE_INLINE int generate_promotions_side(ChessBoard *board, ExtMove *moves,
+                                         MoveGenInfo *info, Side side) {
     int num_moves = 0;
 
-    PawnMoveType capture_types[] = {CAPTURE_LEFT, CAPTURE_RIGHT,
-                                    EN_PASSANT_LEFT, EN_PASSANT_RIGHT};
-    PawnMoveType quiet_types[] = {SINGLE_PUSH, DOUBLE_PUSH};
+    PAWN_MOVES(PAWN_PROMOTION);
+    PAWN_MOVES(PROMOTION_CAPTURE_LEFT);
+    PAWN_MOVES(PROMOTION_CAPTURE_RIGHT);
 
-    PawnMoveType *types = quiet ? quiet_types : capture_types;
-    int len = quiet ? 2 : 4;
+    return filter_pawn_moves(board, info, moves, num_moves);
+}
 
-    for (int i = 0; i < len; i++) {
-        pawn_moves = get_pawn_moves(board, types[i]);
-        num_moves +=
-            extract_pawn_moves(board, moves, num_moves, pawn_moves, types[i]);
+SIDE_INLINE int generate_normal_moves_pawn_side(ChessBoard *board, ExtMove *moves,
+                                                int quiet, MoveGenInfo *info,
+                                                Side side) {
+    int num_moves = 0;
+
+    if (quiet) {
+        PAWN_MOVES(SINGLE_PUSH);
+        PAWN_MOVES(DOUBLE_PUSH);
+    } else {
+        PAWN_MOVES(CAPTURE_LEFT);
+        PAWN_MOVES(CAPTURE_RIGHT);
+        PAWN_MOVES(EN_PASSANT_LEFT);
+        PAWN_MOVES(EN_PASSANT_RIGHT);
     }
 
-    return num_moves;
+    return filter_pawn_moves(board, info, moves, num_moves);
 }
 
-int generate_normal_moves(ChessBoard *board, u64 *moves, int quiet) {
+#undef PAWN_MOVES
+
+SIDE_INLINE int generate_normal_moves_side(ChessBoard *board, ExtMove *moves,
+                                           int quiet, MoveGenInfo *info,
+                                           Side side) {
     int num_moves = 0;
 
+    sync_attacks(board);
+
     // Pawns
-    num_moves += generate_normal_moves_pawn(board, moves, quiet);
+    num_moves += generate_normal_moves_pawn_side(board, moves, quiet, info,
+                                                 side);
 
     // Others
-    u64 enemies = board->bitboards[all_pieces + !board->side];
+    u64 enemies = board->bitboards[all_pieces + !side];
+    u64 friendlies = board->bitboards[all_pieces + side];
     Piece pieces[] = {rook, bishop, queen, knight, king};
     int len = sizeof(pieces) / sizeof(pieces[0]);
 
     // iterate through piece types
     for (int i = 0; i < len; i++) {
         Piece p = pieces[i];
-        u64 piece_bb = board->bitboards[board->side + p];
+        u64 piece_bb = board->bitboards[side + p];
 
         // iterate through piece locations)
         while (piece_bb) {
             int sq = __builtin_ctzll(piece_bb);
-            u64 move_bb = get_moves(board, sq, p);
+            u64 move_bb = cached_attacks(board, sq, p) & ~friendlies;
             move_bb &= (quiet ? ~enemies : enemies);  // **masking**
 
-            num_moves +=
-                extract_moves(board, moves, num_moves, move_bb, sq, p, 0);
+            // legality
+            if (p == king) {
+                move_bb &= ~info->king_danger;
+            } else {
+                move_bb &= info->evasion_mask;
+                if (BB_SQUARE(sq) & info->pinned)
+                    move_bb &= lookup.line[info->king_sq][sq];
+            }
+
+            num_moves += extract_moves(moves, num_moves, move_bb, sq);
 
             BB_CLEAR(piece_bb, sq);
         }
@@ -667,130 +851,510 @@ int generate_normal_moves(ChessBoard *board, u64 *moves, int quiet) {
     return num_moves;
 }
 
-void value_promotions(u64 *moves, int num_moves) {
-    int piece_value[6] = {1, 5, 3, 3, 9, 1000};
-    for (int i = 0; i < num_moves; i++) {
-        u64 move = moves[i];
-        Piece promotion = promote_type(move);
-        u16 value = piece_value[promotion / 2];
-        moves[i] = (move & 0xFFFFFFF) | (u64)value << 28;
-    }
+int generate_promotions(ChessBoard *board, ExtMove *moves, MoveGenInfo *info) {
+    return board->side == white
+               ? generate_promotions_side(board, moves, info, white)
+               : generate_promotions_side(board, moves, info, black);
 }
 
-void value_captures(u64 attack_mask, u64 *moves, int num_moves, int losing) {
-    // values by BLIND: lxh or mxm or (hxl only if l is undefended)
-    int piece_value[6] = {1, 5, 3, 4, 9, 1000};
-    for (int i = 0; i < num_moves; i++) {
-        u64 move = moves[i];
-        u16 value;
-
-        if (piece_value[piece(move) / 2] <= piece_value[captured(move) / 2]) {
-            value = 10 * piece_value[captured(move) / 2] -
-                    piece_value[piece(move) / 2];
-        } else if (!(BB_SQUARE(to(move)) & attack_mask)) {
-            value = 10 * piece_value[captured(move) / 2] -
-                    piece_value[piece(move) / 2];
-        } else {
-            value = 0;
+int generate_normal_moves_pawn(ChessBoard *board, ExtMove *moves, int quiet,
+                               MoveGenInfo *info) {
+    return board->side == white
+               ? generate_normal_moves_pawn_side(board, moves, quiet, info,
+                                                 white)
+               : generate_normal_moves_pawn_side(board, moves, quiet, info,
+                                                 black);
+}
+
+int generate_normal_moves(ChessBoard *board, ExtMove *moves, int quiet,
+                          MoveGenInfo *info) {
+    return board->side == white
+               ? generate_normal_moves_side(board, moves, quiet, info, white)
+               : generate_normal_moves_side(board, moves, quiet, info, black);
+}
+
+// Quiet checks
+// Quiet moves that give check: a piece moves to a square from which it
+// attacks the enemy king, or moves off the line between the king and one of
+// our sliders. Captures and promotions are left to the other stages, and so
+// is castling with check.
+SIDE_INLINE int generate_quiet_checks_side(ChessBoard *board, ExtMove *moves,
+                                           MoveGenInfo *info, Side side) {
+    u64 king_bb = board->bitboards[!side + king];
+    if (!king_bb) return 0;  // only in hand-made test positions
+
+    int ksq = __builtin_ctzll(king_bb);
+    u64 occ = board->bitboards[all_pieces + all];
+    u64 friendlies = board->bitboards[all_pieces + side];
+    u64 enemies = board->bitboards[all_pieces + !side];
+    u64 rooks = board->bitboards[side + rook] | board->bitboards[side + queen];
+    u64 bishops =
+        board->bitboards[side + bishop] | board->bitboards[side + queen];
+
+    // squares each piece type attacks the king from, by piece / 2
+    u64 rook_checks = get_attacks_occ(occ, ksq, rook);
+    u64 bishop_checks = get_attacks_occ(occ, ksq, bishop);
+    u64 direct[6] = {lookup.pawn_attack[!side][ksq],
+                     rook_checks,
+                     lookup.knight_move[ksq],
+                     bishop_checks,
+                     rook_checks | bishop_checks,
+                     0};
+
+    // Discoverers: our sliders that see the king through exactly one of ours,
+    // which checks as soon as it leaves the line
+    u64 discoverers = 0;
+    u64 snipers = (get_attacks_occ(enemies, ksq, rook) & rooks) |
+                  (get_attacks_occ(enemies, ksq, bishop) & bishops);
+    while (snipers) {
+        int sq = __builtin_ctzll(snipers);
+        u64 blockers = lookup.between[ksq][sq] & occ;
+        if (blockers && !(blockers & (blockers - 1))) {
+            discoverers |= blockers & friendlies;
         }
+        BB_CLEAR(snipers, sq);
+    }
+
+    sync_attacks(board);
 
-        if (losing && value > 0) {
-            value = 0;
-        } else if (losing && value == 0) {
-            value = 1001 - piece_value[piece(move) / 2];
+    // Pawns: pushes, filtered down to the checks
+    int num_moves = 0;
+    PawnMoveType pushes[] = {SINGLE_PUSH, DOUBLE_PUSH};
+    for (int i = 0; i < 2; i++) {
+        num_moves += extract_pawn_moves_side(
+            moves, num_moves, get_pawn_moves_side(board, pushes[i], side),
+            pushes[i], side);
+    }
+
+    int num_checks = 0;
+    for (int i = 0; i < num_moves; i++) {
+        int src = from(moves[i].move), dst = to(moves[i].move);
+        if ((BB_SQUARE(dst) & direct[pawn / 2]) ||
+            ((BB_SQUARE(src) & discoverers) &&
+             !(BB_SQUARE(dst) & lookup.line[ksq][src]))) {
+            moves[num_checks++] = moves[i];
         }
+    }
+    num_moves = filter_pawn_moves(board, info, moves, num_checks);
+
+    // Others
+    Piece pieces[] = {rook, bishop, queen, knight, king};
+    int len = sizeof(pieces) / sizeof(pieces[0]);
+
+    for (int i = 0; i < len; i++) {
+        Piece p = pieces[i];
+        u64 piece_bb = board->bitboards[side + p];
+
+        while (piece_bb) {
+            int sq = __builtin_ctzll(piece_bb);
+            u64 check_bb = direct[p / 2];
+            if (BB_SQUARE(sq) & discoverers)
+                check_bb |= ~lookup.line[ksq][sq];
+            u64 move_bb = cached_attacks(board, sq, p) & ~occ & check_bb;
+
+            // legality
+            if (p == king) {
+                move_bb &= ~info->king_danger;
+            } else {
+                move_bb &= info->evasion_mask;
+                if (BB_SQUARE(sq) & info->pinned)
+                    move_bb &= lookup.line[info->king_sq][sq];
+            }
 
-        moves[i] = (move & 0xFFFFFFF) | (u64)value << 28;
+            num_moves += extract_moves(moves, num_moves, move_bb, sq);
+
+            BB_CLEAR(piece_bb, sq);
+        }
     }
+
+    return num_moves;
 }
 
-u64 archeology = 0, killed = 0, killed1 = 0, killed2 = 0, killed3 = 0, counter = 0;
-void value_quiets(ChessBoard *board, u64 *moves, int num_moves,
-                  KillerTable *killer_table, u64 *counter_move, u64 prev_move, int ply) {
-	u64 kill1 = killer_table[ply].move1, kill2 = killer_table[ply].move2;
-	u64 kill3 = 0, kill4 = 0;
-	if (ply >= 2) {
-		kill3 = killer_table[ply - 2].move1, kill4 = killer_table[ply - 2].move2;
-	}
-    kill1 &= 0xFFFFFFF;
-	kill2 &= 0xFFFFFFF;
-	kill3 &= 0xFFFFFFF;
-	kill4 &= 0xFFFFFFF;
+int generate_quiet_checks(ChessBoard *board, ExtMove *moves,
+                          MoveGenInfo *info) {
+    return board->side == white
+               ? generate_quiet_checks_side(board, moves, info, white)
+               : generate_quiet_checks_side(board, moves, info, black);
+}
 
-    // all valued as 0 except move 1 -> 2, move 2 -> 1
-    // Should not move piece to attacked square if square is not defended
+// Move ordering
+// Promotions go ahead of every capture, best piece first
+void value_promotions(ExtMove *moves, int num_moves) {
+    int piece_value[6] = {1, 5, 3, 3, 9, 1000};
     for (int i = 0; i < num_moves; i++) {
-        u64 move = moves[i] & 0xFFFFFFF;
-
-        if (move == kill1) {
-            moves[i] = move | (u64)(2005) << 28;
-            killed++; 
-		} else if (move == kill2) {
-			moves[i] = move | (u64)(2004) << 28;
-			killed1++;
-		} else if (move == kill3) {
-			moves[i] = move | (u64)(2003) << 28;
-			killed2++;
-		} else if (move == kill4) {
-			moves[i] = move | (u64)(2002) << 28;
-			killed3++;
-        } else if (move == counter_move[from(prev_move) * 64 + to(prev_move)]) {
-            moves[i] = move | (u64)(2001) << 28;
-            counter++;
-        } else {
-            int move_val = mg_table[board->side][piece(move) / 2][to(move)] -
-                        mg_table[board->side][piece(move) / 2][from(move)];
-            move_val += 500;
+        moves[i].score = 10000 + piece_value[promote_type(moves[i].move) / 2];
+    }
+}
 
-            moves[i] = move | (u64)move_val << 28;
-			archeology++;
-        }
+// Captures are valued by MVV-LVA, whether they lose material is left to see
+void value_captures(ChessBoard *board, ExtMove *moves, int num_moves) {
+    int piece_value[6] = {1, 5, 3, 4, 9, 1000};
+    for (int i = 0; i < num_moves; i++) {
+        Move move = moves[i].move;
+        moves[i].score = 10 * piece_value[captured_piece(board, move) / 2] -
+                         piece_value[moved_piece(board, move) / 2];
     }
 }
 
-// attackers is squares attacked by !board->side (enemies)
-int generate_moves(ChessBoard *board, u64 *moves, u64 attackers,
-                   MoveGenStage stage) {
+// Quiets are valued by how much the piece gains on its square table
+void value_quiets(ChessBoard *board, ExtMove *moves, int num_moves) {
+    for (int i = 0; i < num_moves; i++) {
+        Move move = moves[i].move;
+        Piece p = moved_piece(board, move);
+        moves[i].score = mg_table[board->side][p / 2][to(move)] -
+                         mg_table[board->side][p / 2][from(move)];
+    }
+}
+
+SIDE_INLINE int generate_moves_side(ChessBoard *board, ExtMove *moves,
+                                    MoveGenInfo *info, MoveGenStage stage,
+                                    Side side) {
     switch (stage) {
         case promotions:
-            return generate_promotions(board, moves);
+            return generate_promotions_side(board, moves, info, side);
 
         case captures:
-            return generate_normal_moves(board, moves, 0);
-
-        case losing:
-            return generate_normal_moves(board, moves, 0);
+            return generate_normal_moves_side(board, moves, 0, info, side);
 
         case castling:
-            return generate_castling(board, moves, attackers, 0);
+            return generate_castling_side(board, moves, info->attacked, 0,
+                                          side);
 
         case quiets:
-            return generate_normal_moves(board, moves, 1);
+            return generate_normal_moves_side(board, moves, 1, info, side);
+
+        case quiet_checks:
+            return generate_quiet_checks_side(board, moves, info, side);
+
+        default:
+            fprintf(stderr,
+                    "Error: Invalid move generation stage [%s(%s):%d]\n",
+                    __FILE__, __func__, __LINE__);
+            exit(1);
     }
+
+    return 0;
 }
 
-void sort_moves(ChessBoard *board, u64 attack_mask, u64 *moves,
-                int num_moves, KillerTable *killer_table, u64 *counter_move,
-                u64 prev_move, MoveGenStage stage, int ply) {
-    switch (stage) {
-        case promotions:
-            value_promotions(moves, num_moves);
-            break;
+// info must be initialized for this position with init_movegen_info
+int generate_moves(ChessBoard *board, ExtMove *moves, MoveGenInfo *info,
+                   MoveGenStage stage) {
+    return board->side == white
+               ? generate_moves_side(board, moves, info, stage, white)
+               : generate_moves_side(board, moves, info, stage, black);
+}
 
-        case captures:
-            value_captures(attack_mask, moves, num_moves, 0);
-            break;
+// Whether a move taken from elsewhere in the tree (hash, killer or counter
+// move) is legal in this position
+int legal_move(ChessBoard *board, MoveGenInfo *info, Move move) {
+    int src = from(move), dst = to(move);
+    MoveType type = move_type(move);
+    Side side = board->side;
+    Piece p = board->mailbox[src];
+    u64 occ = board->bitboards[all_pieces + all];
+    u64 enemies = board->bitboards[all_pieces + !side];
+
+    if (!(BB_SQUARE(src) & board->bitboards[all_pieces + side]) ||
+        (BB_SQUARE(dst) & board->bitboards[all_pieces + side]))
+        return 0;
+
+    if (type == CASTLE_KING || type == CASTLE_QUEEN) {
+        ExtMove castles[2];
+        int num_castles = generate_castling(board, castles, info->attacked, 0);
+        for (int i = 0; i < num_castles; i++) {
+            if (castles[i].move == move) return 1;
+        }
+        return 0;
+    }
 
-        case losing:
-            value_captures(attack_mask, moves, num_moves, 1);
-            break;
+    if (p == pawn) {
+        int push = side == white ? 8 : -8;
+        u64 start = side == white ? RANK_2 : RANK_7;
+        u64 attacks = lookup.pawn_attack[side][src];
+
+        if ((type == PROMOTION) != !!(BB_SQUARE(dst) & (RANK_1 | RANK_8)))
+            return 0;
+        if (type == EN_PASSANT) {
+            if (dst != board->ep || !(attacks & BB_SQUARE(dst))) return 0;
+        } else if (attacks & BB_SQUARE(dst)) {
+            if (!(BB_SQUARE(dst) & enemies)) return 0;
+        } else if (dst == src + push) {
+            if (BB_SQUARE(dst) & occ) return 0;
+        } else if (dst == src + 2 * push && (BB_SQUARE(src) & start)) {
+            if ((BB_SQUARE(dst) | BB_SQUARE(src + push)) & occ) return 0;
+        } else {
+            return 0;
+        }
+        return legal_pawn_move(board, info, move);
+    }
 
-        case castling:
-            break;
+    sync_attacks(board);
+    if (type != NORMAL || !(cached_attacks(board, src, p) & BB_SQUARE(dst)))
+        return 0;
 
-        case quiets:
-            value_quiets(board, moves, num_moves, killer_table, counter_move,
-                         prev_move, ply);
-            break;
+    if (p == king) return !(BB_SQUARE(dst) & info->king_danger);
+    if (!(BB_SQUARE(dst) & info->evasion_mask)) return 0;
+    if (BB_SQUARE(src) & info->pinned)
+        return (lookup.line[info->king_sq][src] & BB_SQUARE(dst)) != 0;
+    return 1;
+}
+
+// Move picker
+void init_move_picker(MovePicker *mp, ChessBoard *board, MoveGenInfo *info,
+                      Move hash_move, KillerTable *killer_table,
+                      Move *counter_move, HistoryTables *history,
+                      PieceToHistory **cont, Move prev_move, int ply) {
+    mp->board = board;
+    mp->info = info;
+    mp->stage = pick_hash;
+    mp->quiets = 1;
+    mp->checks = 0;
+    mp->threshold = 0;
+    mp->hash_move = hash_move;
+
+    mp->num_killers = 0;
+    mp->killers[mp->num_killers++] = killer_table[ply].move1;
+    mp->killers[mp->num_killers++] = killer_table[ply].move2;
+    if (ply >= 2) {
+        mp->killers[mp->num_killers++] = killer_table[ply - 2].move1;
+        mp->killers[mp->num_killers++] = killer_table[ply - 2].move2;
     }
+    mp->counter =
+        prev_move ? counter_move[from(prev_move) * 64 + to(prev_move)] : 0;
+    mp->history = history;
+    mp->cont[0] = cont ? cont[0] : NULL;
+    mp->cont[1] = cont ? cont[1] : NULL;
+
+    mp->num_played = 0;
+}
+
+// Quiescence: promotions and the captures that win at least `threshold`
+// by see, which must be at least 0
+void init_capture_picker(MovePicker *mp, ChessBoard *board, MoveGenInfo *info,
+                         int threshold, int checks) {
+    mp->board = board;
+    mp->info = info;
+    mp->stage = pick_init_captures;
+    mp->quiets = 0;
+    mp->checks = checks;
+    mp->threshold = threshold;
+    mp->hash_move = 0;
+    mp->num_killers = 0;
+    mp->counter = 0;
+    mp->history = NULL;
+    mp->num_played = 0;
+}
+
+static int already_played(MovePicker *mp, Move move) {
+    for (int i = 0; i < mp->num_played; i++) {
+        if (mp->played[i] == move) return 1;
+    }
+    return 0;
+}
+
+// hash, killer or counter move: searched ahead of its group if it is legal
+// here and wasn't searched yet. Killers and counter moves must be quiet.
+static int pick_special(MovePicker *mp, Move move, int quiet) {
+    if (!move || already_played(mp, move)) return 0;
+    if (quiet && (captured_piece(mp->board, move) != empty ||
+                  move_type(move) == PROMOTION))
+        return 0;
+    if (!legal_move(mp->board, mp->info, move)) return 0;
+
+    mp->played[mp->num_played++] = move;
+    return 1;
+}
+
+// History on top of the static ordering: it breaks MVV-LVA ties between
+// captures and takes over from the square tables for quiets
+static void add_capture_history(MovePicker *mp, ExtMove *moves, int num_moves) {
+    if (!mp->history) return;
+
+    Side side = mp->board->side;
+    for (int i = 0; i < num_moves; i++) {
+        Move move = moves[i].move;
+        Piece p = moved_piece(mp->board, move);
+        Piece captured = captured_piece(mp->board, move);
+        moves[i].score =
+            moves[i].score * 16 +
+            mp->history->capture[side + p][to(move)][captured / 2] / 64;
+    }
+}
+
+static void add_quiet_history(MovePicker *mp, ExtMove *moves, int num_moves) {
+    if (!mp->history) return;
+
+    Side side = mp->board->side;
+    for (int i = 0; i < num_moves; i++) {
+        Move move = moves[i].move;
+        int pc = side + moved_piece(mp->board, move), dst = to(move);
+        int score =
+            moves[i].score + mp->history->butterfly[side][from(move)][dst];
+        for (int j = 0; j < 2; j++) {
+            if (mp->cont[j]) score += (*mp->cont[j])[pc][dst];
+        }
+        moves[i].score = score;
+    }
+}
+
+// Selection sort step: swaps the best move of [start, end) to start
+static Move pick_best(ExtMove *moves, int start, int end) {
+    int best = start;
+    for (int i = start + 1; i < end; i++) {
+        if (moves[i].score > moves[best].score) best = i;
+    }
+
+    ExtMove tmp = moves[best];
+    moves[best] = moves[start];
+    moves[start] = tmp;
+    return tmp.move;
+}
+
+Move next_move(MovePicker *mp) {
+    Move move;
+
+    switch (mp->stage) {
+        case pick_hash:
+            mp->stage = pick_init_captures;
+            if (pick_special(mp, mp->hash_move, 0)) {
+                mp->picked = pick_hash;
+                return mp->hash_move;
+            }
+            // fall through
+
+        case pick_init_captures: {
+            int num_promotions =
+                generate_moves(mp->board, mp->moves, mp->info, promotions);
+            value_promotions(mp->moves, num_promotions);
+            int num_captures = generate_moves(
+                mp->board, mp->moves + num_promotions, mp->info, captures);
+            value_captures(mp->board, mp->moves + num_promotions,
+                           num_captures);
+            add_capture_history(mp, mp->moves + num_promotions, num_captures);
+
+            mp->num_bad = 0;
+            mp->cur = 0;
+            mp->end = num_promotions + num_captures;
+            mp->stage = pick_good_captures;
+        }
+            // fall through
+
+        case pick_good_captures:
+            while (mp->cur < mp->end) {
+                move = pick_best(mp->moves, mp->cur++, mp->end);
+                if (already_played(mp, move)) continue;
+
+                // Losing captures are set aside, into the used up slots at
+                // the front, and valued by how much they lose (or win, if
+                // below a quiescence threshold)
+                if (move_type(move) != PROMOTION) {
+                    int gain = see(mp->board, move);
+                    if (gain < mp->threshold) {
+                        mp->moves[mp->cur - 1] = mp->moves[mp->num_bad];
+                        mp->moves[mp->num_bad].move = move;
+                        mp->moves[mp->num_bad++].score = gain;
+                        continue;
+                    }
+                }
+
+                mp->picked = pick_good_captures;
+                return move;
+            }
+            if (!mp->quiets) {
+                if (!mp->checks) {
+                    mp->stage = pick_done;
+                    return 0;
+                }
+                // quiescence goes on to the quiet checks, further down
+                mp->stage = pick_init_checks;
+                return next_move(mp);
+            }
+            mp->stage = pick_killers;
+            mp->cur = 0;
+            // fall through
+
+        case pick_killers:
+            while (mp->cur < mp->num_killers) {
+                move = mp->killers[mp->cur++];
+                if (pick_special(mp, move, 1)) {
+                    mp->picked = pick_killers;
+                    return move;
+                }
+            }
+            mp->stage = pick_counter;
+            // fall through
+
+        case pick_counter:
+            mp->stage = pick_init_quiets;
+            if (pick_special(mp, mp->counter, 1)) {
+                mp->picked = pick_counter;
+                return mp->counter;
+            }
+            // fall through
+
+        case pick_init_quiets: {
+            // quiets go after the captures, whose good half is used up
+            ExtMove *quiet_moves = mp->moves + mp->end;
+            int num_quiets =
+                generate_moves(mp->board, quiet_moves, mp->info, castling);
+            num_quiets += generate_moves(mp->board, quiet_moves + num_quiets,
+                                         mp->info, quiets);
+            value_quiets(mp->board, quiet_moves, num_quiets);
+            add_quiet_history(mp, quiet_moves, num_quiets);
+
+            mp->cur = mp->end;
+            mp->end += num_quiets;
+            mp->stage = pick_quiets;
+        }
+            // fall through
+
+        case pick_quiets:
+            while (mp->cur < mp->end) {
+                move = pick_best(mp->moves, mp->cur++, mp->end);
+                if (already_played(mp, move)) continue;
+                mp->picked = pick_quiets;
+                return move;
+            }
+            mp->stage = pick_bad_captures;
+            mp->cur = 0;
+            // fall through
+
+        case pick_bad_captures:
+            while (mp->cur < mp->num_bad) {
+                move = pick_best(mp->moves, mp->cur++, mp->num_bad);
+                mp->picked = pick_bad_captures;
+                return move;
+            }
+            mp->stage = pick_done;
+            return 0;
+
+        case pick_init_checks: {
+            // after the captures, like the quiets in the full search
+            ExtMove *check_moves = mp->moves + mp->end;
+            int num_checks =
+                generate_moves(mp->board, check_moves, mp->info, quiet_checks);
+            value_quiets(mp->board, check_moves, num_checks);
+
+            mp->cur = mp->end;
+            mp->end += num_checks;
+            mp->stage = pick_checks;
+        }
+            // fall through
+
+        case pick_checks:
+            while (mp->cur < mp->end) {
+                move = pick_best(mp->moves, mp->cur++, mp->end);
+                // checks that hang the piece are skipped, like bad captures
+                if (see(mp->board, move) < 0) continue;
+                mp->picked = pick_checks;
+                return move;
+            }
+            mp->stage = pick_done;
+            // fall through
+
+        case pick_done:
+            return 0;
+    }
+
+    return 0;
 }
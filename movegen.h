@@ -7,13 +7,11 @@
 #include "search.h"
 
 // Move representation
-// moves are packed into a u64 (LSB -> MSB)
+// moves are packed into a u16 (LSB -> MSB)
 // 0-5: from square
 // 6-11: to square
-// 12-15: piece
-// 16-19: capture piece
-// 20-23: move type
-// 24-27: promote type
+// 12-15: move type, promotions use PROMOTION + the index of the piece
+// the moving and captured pieces are read off the board
 
 typedef enum {
     SINGLE_PUSH,
@@ -31,55 +29,139 @@ typedef enum {
 typedef enum {
     NORMAL,
     EN_PASSANT,
-    PROMOTION,
     CASTLE_KING,
     CASTLE_QUEEN,
+    PROMOTION,  // 4-7: rook, knight, bishop, queen
 
-    UNKNOWN,
+    UNKNOWN = 8,
 } MoveType;
 
+#define MOVE(from, to, type) ((Move)((from) | (to) << 6 | (type) << 12))
+#define PROMOTION_MOVE(from, to, p) MOVE(from, to, PROMOTION + (p) / 2 - 1)
+
 // Move Generation Stage
 typedef enum {
     promotions,
     captures,
     castling,
     quiets,
-    losing,
+    quiet_checks,  // quiescence only, see generate_quiet_checks
 } MoveGenStage;
 
+// Legality info for the side to move, computed once per node so that the
+// generators below only emit legal moves
+typedef struct {
+    u64 attacked;      // squares attacked by the enemy
+    u64 king_danger;   // squares our king can't move to
+    u64 checkers;      // enemy pieces giving check
+    u64 pinned;        // our pieces pinned to our king
+    u64 evasion_mask;  // targets for non-king moves (all if not in check)
+    int king_sq;
+} MoveGenInfo;
+
+void init_movegen_info(ChessBoard *board, u64 attacked, MoveGenInfo *info);
+int legal_pawn_move(ChessBoard *board, MoveGenInfo *info, Move move);
+int filter_pawn_moves(ChessBoard *board, MoveGenInfo *info, ExtMove *moves,
+                      int num_moves);
+
 // Pawns
 u64 get_pawn_moves(ChessBoard *board, PawnMoveType move_type);
-int extract_pawn_moves(ChessBoard *board, u64 *moves, int move_p,
+int extract_pawn_moves(ChessBoard *board, ExtMove *moves, int move_p,
                        u64 pawn_moves, PawnMoveType move_type);
 
 // Other pieces
 u64 get_moves(ChessBoard *board, int sq, Piece p);
-int extract_moves(ChessBoard *board, u64 *moves, int move_p, u64 move_bb,
-                  int sq, Piece p, int quiet);
-int extract_all_moves(ChessBoard *board, u64 *moves, int move_p, Piece p);
+int extract_moves(ExtMove *moves, int move_p, u64 move_bb, int sq);
+int extract_all_moves(ChessBoard *board, ExtMove *moves, int move_p, Piece p);
 
 // Castling
-int generate_castling(ChessBoard *board, u64 *moves, u64 attacked, int move_p);
+int generate_castling(ChessBoard *board, ExtMove *moves, u64 attacked,
+                      int move_p);
 
 // Attackers
+#ifdef HAS_PEXT
+u64 get_pext_attacks(u64 occ, int sq, Piece p);
+#endif
+u64 get_attacks_occ(u64 occ, int sq, Piece p);
 u64 get_attacks(ChessBoard *board, int sq, Piece p);
 u64 attackers(ChessBoard *board, Side side);
+u64 attackers_occ(ChessBoard *board, Side side, u64 occ);
 int is_legal(ChessBoard *board, u64 attacked, Side side);
+int side_in_check(ChessBoard *board);
 
-// Move Generation
-int generate_promotions(ChessBoard *board, u64 *moves);
-int generate_normal_moves_pawn(ChessBoard *board, u64 *moves, int quiet);
-int generate_normal_moves(ChessBoard *board, u64 *moves, int quiet);
-int generate_moves(ChessBoard *board, u64 *moves, u64 attackers,
+// Attacks of the piece on sq, as kept by the attack cache (see sync_attacks)
+u64 piece_attacks(ChessBoard *board, int sq);
+
+// Static exchange evaluation
+u64 attackers_to(ChessBoard *board, int sq, u64 occ);
+int see(ChessBoard *board, Move move);
+
+// Move Generation (legal moves only)
+int generate_promotions(ChessBoard *board, ExtMove *moves, MoveGenInfo *info);
+int generate_normal_moves_pawn(ChessBoard *board, ExtMove *moves, int quiet,
+                               MoveGenInfo *info);
+int generate_normal_moves(ChessBoard *board, ExtMove *moves, int quiet,
+                          MoveGenInfo *info);
+int generate_quiet_checks(ChessBoard *board, ExtMove *moves,
+                          MoveGenInfo *info);
+int generate_moves(ChessBoard *board, ExtMove *moves, MoveGenInfo *info,
                    MoveGenStage stage);
 
 // Move ordering
-void sort_moves(ChessBoard *board, u64 attack_mask, u64 *moves, int num_moves,
-                KillerTable *killer_table, u64 *counter_move, u64 prev_move,
-                MoveGenStage stage, int ply);
+void value_promotions(ExtMove *moves, int num_moves);
+void value_captures(ChessBoard *board, ExtMove *moves, int num_moves);
+void value_quiets(ChessBoard *board, ExtMove *moves, int num_moves);
+int legal_move(ChessBoard *board, MoveGenInfo *info, Move move);
+
+// Move picker stages, in the order the moves are returned
+typedef enum {
+    pick_hash,
+    pick_init_captures,
+    pick_good_captures,
+    pick_init_checks,  // quiescence only
+    pick_checks,
+    pick_killers,
+    pick_counter,
+    pick_init_quiets,
+    pick_quiets,
+    pick_bad_captures,
+    pick_done,
+} PickStage;
+
+// Yields the legal moves of a node best first, see next_move
+typedef struct {
+    ChessBoard *board;
+    MoveGenInfo *info;
+    PickStage stage;   // next stage to run
+    PickStage picked;  // stage of the last move returned
+    int quiets;        // 0 in quiescence: stop after the good captures
+    int checks;        // quiescence: quiet checks after the good captures
+    int threshold;     // captures that win less by see are bad
+
+    Move hash_move;
+    Move killers[4];
+    int num_killers;
+    Move counter;
+    HistoryTables *history;  // NULL: static ordering only
+    PieceToHistory *cont[2];  // one and two plies back, or NULL
+    Move played[6];  // hash, killer and counter moves already returned
+    int num_played;
+
+    // losing captures in [0, num_bad), the group being picked in [cur, end)
+    ExtMove moves[256];
+    int num_bad, cur, end;
+} MovePicker;
+
+void init_move_picker(MovePicker *mp, ChessBoard *board, MoveGenInfo *info,
+                      Move hash_move, KillerTable *killer_table,
+                      Move *counter_move, HistoryTables *history,
+                      PieceToHistory **cont, Move prev_move, int ply);
+void init_capture_picker(MovePicker *mp, ChessBoard *board, MoveGenInfo *info,
+                         int threshold, int checks);
+Move next_move(MovePicker *mp);
 
 // Utilities
-u64 move_from_uci(ChessBoard *board, char *uci);
-void move_to_uci(u64 move, char *uci);
+Move move_from_uci(ChessBoard *board, char *uci);
+void move_to_uci(Move move, char *uci);
 
 #endif  // MOVEGEN_H
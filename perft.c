@@ -1,6 +1,12 @@
+// clock_gettime
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "board.h"
 #include "common.h"
@@ -11,180 +17,500 @@
 #include "movegen.h"
 #include "rng.h"
 
-u64 perft(ChessBoard board, int depth) {
+// Moves are generated legal, so the last ply only needs counting
+u64 count_moves(ChessBoard *board, MoveGenInfo *info) {
+    ExtMove moves[256];
+    u64 total_moves = 0;
+
+    MoveGenStage stage[] = {promotions, captures, castling, quiets};
+    int len = sizeof(stage) / sizeof(stage[0]);
+    for (int i = 0; i < len; i++) {
+        total_moves += generate_moves(board, moves, info, stage[i]);
+    }
+
+    return total_moves;
+}
+
+u64 perft(ChessBoard *board, int depth) {
     if (depth == 0) return 1;
 
     u64 total_moves = 0;
-    u64 moves[256];
+    ExtMove moves[256];
     int num_moves;
+    Undo undo;
+
+    MoveGenInfo info;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+    if (depth == 1) return count_moves(board, &info);
 
     MoveGenStage stage[] = {promotions, captures, castling, quiets};
     int len = sizeof(stage) / sizeof(stage[0]);
     for (int i = 0; i < len; i++) {
-        num_moves = generate_moves(&board, moves,
-                                   attackers(&board, !board.side), stage[i]);
+        num_moves = generate_moves(board, moves, &info, stage[i]);
 
         for (int move_p = 0; move_p < num_moves; move_p++) {
-            ChessBoard new_board = make_move(board, moves[move_p]);
-            if (is_legal(&new_board, attackers(&new_board, new_board.side),
-                         !new_board.side)) {
-                total_moves += perft(new_board, depth - 1);
-            }
+            do_move(board, moves[move_p].move, &undo);
+            total_moves += perft(board, depth - 1);
+            undo_move(board, moves[move_p].move, &undo);
         }
     }
 
     return total_moves;
 }
 
-u64 _test_zobrist_helper(ChessBoard board, int depth) {
+// Copy-make version of perft, kept to benchmark against make/unmake
+u64 perft_copy_make(ChessBoard board, int depth) {
     if (depth == 0) return 1;
 
     u64 total_moves = 0;
-    u64 moves[256];
+    ExtMove moves[256];
     int num_moves;
 
+    MoveGenInfo info;
+    init_movegen_info(&board, attackers(&board, !board.side), &info);
+    if (depth == 1) return count_moves(&board, &info);
+
     MoveGenStage stage[] = {promotions, captures, castling, quiets};
     int len = sizeof(stage) / sizeof(stage[0]);
     for (int i = 0; i < len; i++) {
-        num_moves = generate_moves(&board, moves,
-                                   attackers(&board, !board.side), stage[i]);
+        num_moves = generate_moves(&board, moves, &info, stage[i]);
 
         for (int move_p = 0; move_p < num_moves; move_p++) {
-            ChessBoard new_board = make_move(board, moves[move_p]);
-            assert(new_board.hash == manual_compute_hash(&new_board));
-            if (is_legal(&new_board, attackers(&new_board, new_board.side),
-                         !new_board.side)) {
-                total_moves += perft(new_board, depth - 1);
-            }
+            ChessBoard new_board = make_move(board, moves[move_p].move);
+            total_moves += perft_copy_make(new_board, depth - 1);
         }
     }
 
     return total_moves;
 }
 
-u64 hash_hits = 0, greater_hits = 0, hash_stores = 0;
-u64 _test_hash_table_helper(ChessBoard board, int depth) {
-    // load
-    u64 entry;
-    if ((entry = probe(board.hash)) && (int)(entry & 0xFF) >= depth) {
-        if ((entry & 0xFF) == depth) {
-            hash_hits++;
-            return (entry >> 8) & 0xFFFFFFFFFFFFFF;
+u64 _test_zobrist_helper(ChessBoard *board, int depth) {
+    if (depth == 0) return 1;
+
+    u64 total_moves = 0;
+    ExtMove moves[256];
+    int num_moves;
+    Undo undo;
+
+    MoveGenInfo info;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+
+    MoveGenStage stage[] = {promotions, captures, castling, quiets};
+    int len = sizeof(stage) / sizeof(stage[0]);
+    for (int i = 0; i < len; i++) {
+        num_moves = generate_moves(board, moves, &info, stage[i]);
+
+        for (int move_p = 0; move_p < num_moves; move_p++) {
+            do_move(board, moves[move_p].move, &undo);
+            assert(board->hash == manual_compute_hash(board));
+            total_moves += _test_zobrist_helper(board, depth - 1);
+            undo_move(board, moves[move_p].move, &undo);
+            assert(board->hash == manual_compute_hash(board));
         }
-        greater_hits++;
     }
 
+    return total_moves;
+}
+
+// perft with a transposition table, for deep counts. Depth 1 is bulk
+// counted and cheaper to recompute than to cache.
+u64 perft_hashed(ChessBoard *board, int depth) {
     if (depth == 0) return 1;
 
     u64 total_moves = 0;
-    u64 moves[256];
+    if (depth > 1 && perft_probe(board->hash, depth, &total_moves))
+        return total_moves;
+
+    ExtMove moves[256];
     int num_moves;
+    Undo undo;
+
+    MoveGenInfo info;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+    if (depth == 1) return count_moves(board, &info);
 
     MoveGenStage stage[] = {promotions, captures, castling, quiets};
     int len = sizeof(stage) / sizeof(stage[0]);
-    u64 attack_mask = attackers(&board, !board.side);
     for (int i = 0; i < len; i++) {
-        num_moves = generate_moves(&board, moves, attack_mask, stage[i]);
+        num_moves = generate_moves(board, moves, &info, stage[i]);
 
         for (int move_p = 0; move_p < num_moves; move_p++) {
-            ChessBoard new_board = make_move(board, moves[move_p]);
-            if (is_legal(&new_board, attackers(&new_board, new_board.side),
-                         !new_board.side)) {
-                total_moves += _test_hash_table_helper(new_board, depth - 1);
-            }
+            do_move(board, moves[move_p].move, &undo);
+            total_moves += perft_hashed(board, depth - 1);
+            undo_move(board, moves[move_p].move, &undo);
         }
     }
 
-    raw_store(board.hash, (depth & 0xFF) | ((total_moves << 8) &
-                                            0xFFFFFFFFFFFFFF));  // store
-    hash_stores++;
+    perft_store(board->hash, depth, total_moves);
     return total_moves;
 }
 
-u64 _test_incremental_eval(ChessBoard board, int depth) {
+u64 _test_incremental_eval(ChessBoard *board, int depth) {
     if (depth == 0) return 1;
 
     u64 total_moves = 0;
-    u64 moves[256];
+    ExtMove moves[256];
     int num_moves;
+    Undo undo;
+
+    MoveGenInfo info;
+    init_movegen_info(board, attackers(board, !board->side), &info);
 
     MoveGenStage stage[] = {promotions, captures, castling, quiets};
     int len = sizeof(stage) / sizeof(stage[0]);
     for (int i = 0; i < len; i++) {
-        num_moves = generate_moves(&board, moves,
-                                   attackers(&board, !board.side), stage[i]);
+        num_moves = generate_moves(board, moves, &info, stage[i]);
 
         for (int move_p = 0; move_p < num_moves; move_p++) {
-            ChessBoard new_board = make_move(board, moves[move_p]);
+            do_move(board, moves[move_p].move, &undo);
 
             // check for right scores
             int mg[2];
-            memcpy(mg, new_board.mg, sizeof(new_board.mg));
+            memcpy(mg, board->mg, sizeof(board->mg));
 
-            manual_score_gen(&new_board);
-            assert(mg[0] == new_board.mg[0] && mg[1] == new_board.mg[1]);
+            manual_score_gen(board);
+            assert(mg[0] == board->mg[0] && mg[1] == board->mg[1]);
 
-            if (is_legal(&new_board, attackers(&new_board, new_board.side),
-                         !new_board.side)) {
-                total_moves += _test_incremental_eval(new_board, depth - 1);
-            }
+            total_moves += _test_incremental_eval(board, depth - 1);
+            undo_move(board, moves[move_p].move, &undo);
         }
     }
 
     return total_moves;
 }
 
-u64 divide(ChessBoard board, int depth) {
-    if (depth == 0) return 1;
+double seconds_since(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
 
-    u64 total_moves = 0;
-    u64 moves[256];
+// Compares perft speed of make/unmake against copy-make
+void bench_make_unmake(ChessBoard *board, int depth) {
+    struct timespec start;
+    u64 nodes;
+    double t;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    nodes = perft_copy_make(*board, depth);
+    t = seconds_since(start);
+    printf("copy-make:   %llu nodes, %.3fs, %.2f Mnps\n", nodes, t,
+           nodes / t / 1e6);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    nodes = perft(board, depth);
+    t = seconds_since(start);
+    printf("make/unmake: %llu nodes, %.3fs, %.2f Mnps\n", nodes, t,
+           nodes / t / 1e6);
+}
+
+// Compares the magic and PEXT slider attack backends, on random lookups and
+// on perft
+void bench_slider_attacks(ChessBoard *board, int depth) {
+#ifdef HAS_PEXT
+    if (!pext_supported()) {
+        printf("pext: not supported by this CPU\n");
+        return;
+    }
+
+    char *names[] = {"magic", "pext"};
+    int use_pext = lookup.use_pext;
+    int lookups = 1 << 22;
+    u64 occ[1024];
+    volatile u64 sink = 0;
+
+    for (int i = 0; i < 1024; i++) {
+        occ[i] = genrand64_int64() & genrand64_int64();
+    }
+
+    for (int backend = 0; backend < 2; backend++) {
+        struct timespec start;
+        u64 attacks = 0;
+        lookup.use_pext = backend;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < lookups; i += 2) {
+            u64 o = occ[i & 1023];
+            attacks ^= get_attacks_occ(o, i & 63, rook);
+            attacks ^= get_attacks_occ(o, (i >> 6) & 63, bishop);
+        }
+        double t = seconds_since(start);
+        sink ^= attacks;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        u64 nodes = perft(board, depth);
+        double perft_t = seconds_since(start);
+
+        printf("%-6s %.2f ns/lookup, perft %.2f Mnps\n", names[backend],
+               t * 1e9 / lookups, nodes / perft_t / 1e6);
+    }
+
+    lookup.use_pext = use_pext;
+    (void)sink;
+#else
+    (void)board;
+    (void)depth;
+    printf("pext: not built in\n");
+#endif
+}
+
+// Root split: each thread takes root moves off a shared counter and searches
+// them on its own copy of the board, so uneven subtrees still spread across
+// the pool
+typedef struct {
+    ChessBoard board;
+    ExtMove moves[256];
+    u64 nodes[256];
     int num_moves;
+    int depth;
+    int hashed;
+    int next;
+} PerftRoot;
+
+PerftRoot root;
+
+void *perft_worker(void *arg) {
+    (void)arg;
+    ChessBoard board = root.board;
+    Undo undo;
+    int i;
+
+    while ((i = __atomic_fetch_add(&root.next, 1, __ATOMIC_RELAXED)) <
+           root.num_moves) {
+        do_move(&board, root.moves[i].move, &undo);
+        root.nodes[i] = root.hashed ? perft_hashed(&board, root.depth - 1)
+                                    : perft(&board, root.depth - 1);
+        undo_move(&board, root.moves[i].move, &undo);
+    }
+
+    return NULL;
+}
+
+u64 perft_parallel(ChessBoard *board, int depth, int num_threads, int hashed) {
+    if (depth == 0) return 1;
+
+    MoveGenInfo info;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+
+    root.board = *board;
+    root.depth = depth;
+    root.hashed = hashed;
+    root.next = 0;
+    root.num_moves = 0;
 
     MoveGenStage stage[] = {promotions, captures, castling, quiets};
     int len = sizeof(stage) / sizeof(stage[0]);
     for (int i = 0; i < len; i++) {
-        num_moves = generate_moves(&board, moves,
-                                   attackers(&board, !board.side), stage[i]);
+        root.num_moves += generate_moves(board, root.moves + root.num_moves,
+                                         &info, stage[i]);
+    }
 
-        for (int move_p = 0; move_p < num_moves; move_p++) {
-            ChessBoard new_board = make_move(board, moves[move_p]);
-            if (is_legal(&new_board, attackers(&new_board, new_board.side),
-                         !new_board.side)) {
-                u64 nodes = perft(new_board, depth - 1);
-                char ascii_move[6];
-                move_to_uci(moves[move_p], ascii_move);
-                printf("%s: %llu\n", ascii_move, nodes);
-                total_moves += nodes;
-            }
-        }
+    if (num_threads > root.num_moves) num_threads = root.num_moves;
+    pthread_t *pool = malloc(sizeof(pthread_t) * (num_threads + 1));
+    for (int t = 1; t < num_threads; t++) {
+        pthread_create(&pool[t], NULL, perft_worker, NULL);
+    }
+    perft_worker(NULL);
+    for (int t = 1; t < num_threads; t++) {
+        pthread_join(pool[t], NULL);
+    }
+    free(pool);
+
+    u64 total_moves = 0;
+    for (int i = 0; i < root.num_moves; i++) {
+        total_moves += root.nodes[i];
     }
 
     return total_moves;
 }
 
-int main(void) {
-    global_init();
+// prints the node count below each root move of the last perft_parallel
+void divide(void) {
+    for (int i = 0; i < root.num_moves; i++) {
+        char ascii_move[6];
+        move_to_uci(root.moves[i].move, ascii_move);
+        printf("%s: %llu\n", ascii_move, root.nodes[i]);
+    }
+    printf("\n");
+}
+
+// Standard perft positions with known counts, nodes[d - 1] at depth d (0 if
+// not checked). The suite runs each position to its deepest known count.
+typedef struct {
+    char *name;
+    char *fen;
+    u64 nodes[8];
+} PerftCase;
+
+PerftCase perft_suite_cases[] = {
+    {"startpos",
+     "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+     {20, 400, 8902, 197281, 4865609, 119060324}},
+    {"kiwipete",
+     "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+     {48, 2039, 97862, 4085603, 193690690}},
+    {"position 3", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+     {14, 191, 2812, 43238, 674624, 11030083}},
+    {"position 4",
+     "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+     {6, 264, 9467, 422333, 15833292}},
+    {"position 4 mirrored",
+     "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1",
+     {6, 264, 9467, 422333, 15833292}},
+    {"position 5",
+     "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+     {44, 1486, 62379, 2103487, 89941194}},
+    {"position 6",
+     "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - "
+     "0 10",
+     {46, 2079, 89890, 3894594, 164075551}},
+    {"illegal ep 1", "3k4/3p4/8/K1P4r/8/8/8/8 b - - 0 1",
+     {0, 0, 0, 0, 0, 1134888}},
+    {"illegal ep 2", "8/8/4k3/8/2p5/8/B2P2K1/8 w - - 0 1",
+     {0, 0, 0, 0, 0, 1015133}},
+    {"ep gives check", "8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1",
+     {0, 0, 0, 0, 0, 1440467}},
+    {"short castle gives check", "5k2/8/8/8/8/8/8/4K2R w K - 0 1",
+     {0, 0, 0, 0, 0, 661072}},
+    {"long castle gives check", "3k4/8/8/8/8/8/8/R3K3 w Q - 0 1",
+     {0, 0, 0, 0, 0, 803711}},
+    {"castle rights", "r3k2r/1b4bq/8/8/8/8/7B/R3K2R w KQkq - 0 1",
+     {0, 0, 0, 1274206}},
+    {"castling prevented", "r3k2r/8/3Q4/8/8/5q2/8/R3K2R b KQkq - 0 1",
+     {0, 0, 0, 1720476}},
+    {"promote out of check", "2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1",
+     {0, 0, 0, 0, 0, 3821001}},
+    {"discovered check", "8/8/1P2K3/8/2n5/1q6/8/5k2 b - - 0 1",
+     {0, 0, 0, 0, 1004658}},
+    {"promote to give check", "4k3/1P6/8/8/8/8/K7/8 w - - 0 1",
+     {0, 0, 0, 0, 0, 217342}},
+    {"underpromote to check", "8/P1k5/K7/8/8/8/8/8 w - - 0 1",
+     {0, 0, 0, 0, 0, 92683}},
+    {"self stalemate", "K1k5/8/P7/8/8/8/8/8 w - - 0 1",
+     {0, 0, 0, 0, 0, 2217}},
+    {"stalemate and checkmate 1", "8/k1P5/8/1K6/8/8/8/8 w - - 0 1",
+     {0, 0, 0, 0, 0, 0, 567584}},
+    {"stalemate and checkmate 2", "8/8/2k5/5q2/5n2/8/5K2/8 b - - 0 1",
+     {0, 0, 0, 23527}},
+};
+
+// Returns the number of failed positions
+int perft_suite(int num_threads, int hashed) {
+    int num_cases = sizeof(perft_suite_cases) / sizeof(perft_suite_cases[0]);
+    int failed = 0;
+    u64 total_nodes = 0;
+    double total_time = 0;
+
+    for (int i = 0; i < num_cases; i++) {
+        PerftCase *c = &perft_suite_cases[i];
+        ChessBoard board;
+        ChessBoard_from_FEN(&board, c->fen);
+        if (hashed) clear_perft_table();
+
+        int pass = 1, depth = 0;
+        u64 nodes = 0, case_nodes = 0;
+        double t = 0;
+        for (int d = 1; d <= 8 && pass; d++) {
+            if (!c->nodes[d - 1]) continue;
+
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            nodes = perft_parallel(&board, d, num_threads, hashed);
+            t += seconds_since(start);
+            case_nodes += nodes;
+            depth = d;
+            pass = nodes == c->nodes[d - 1];
+        }
+        total_nodes += case_nodes;
+        total_time += t;
+
+        printf("%-4s %-26s depth %d: %llu", pass ? "ok" : "FAIL", c->name,
+               depth, nodes);
+        if (!pass) printf(" (expected %llu)", c->nodes[depth - 1]);
+        printf(", %.2f Mnps\n", t > 0 ? case_nodes / t / 1e6 : 0.0);
+        failed += !pass;
+    }
+
+    printf("\n%d/%d passed, %llu nodes, %.3fs, %.2f Mnps\n",
+           num_cases - failed, num_cases, total_nodes, total_time,
+           total_time > 0 ? total_nodes / total_time / 1e6 : 0.0);
+
+    return failed;
+}
+
+void usage(char *prog) {
+    fprintf(stderr,
+            "Usage: %s [<fen> <depth>] [--threads N] [--divide] [--hash MB] "
+            "[--bench] [--suite]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    init_board_globals();
 
     ChessBoard board;
-    char
-        starting_fen[] =
-            "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - "
-            "0 1";  // kiwipete
-                    // char starting_fen[] =
-    // "r1bqkb1r/pppp1ppp/2n5/1B2p3/4n3/5N2/PPPP1PPP/RNBQ1RK1 w kq - 0 5";  //
-    // search position char starting_fen[] = "k7/8/8/8/8/8/8/K7 w - - 0 1"  //
-    // test only
-    ChessBoard_from_FEN(&board, starting_fen);
-
-    for (int depth = 1; depth <= 5; depth++) {
-        // u64 nodes = perft(board, depth);
-        hash_hits = 0;
-        hash_stores = 0;
-        u64 nodes = _test_hash_table_helper(board, depth);
-        printf("Depth %d: %llu, Hits: %llu, Stores: %llu\n", depth, nodes,
-               hash_hits, hash_stores);
+    char fen[256] =
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - "
+        "0 1";  // kiwipete
+    int depth = 5, num_threads = 1, show_divide = 0, bench = 0, suite = 0;
+    u64 hash_mb = 0;
+    char *args[16];
+    int num_args = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc) {
+            hash_mb = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--divide") == 0) {
+            show_divide = 1;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "--suite") == 0) {
+            suite = 1;
+        } else if (strncmp(argv[i], "--", 2) == 0 || num_args == 16) {
+            usage(argv[0]);
+        } else {
+            args[num_args++] = argv[i];
+        }
+    }
+
+    // The FEN may be quoted or passed as separate fields, the depth is last
+    if (num_args == 1) usage(argv[0]);
+    if (num_args > 1) {
+        char *end;
+        depth = strtol(args[num_args - 1], &end, 10);
+        if (*end || depth < 0) usage(argv[0]);
+
+        fen[0] = '\0';
+        for (int i = 0; i < num_args - 1; i++) {
+            if (i) strncat(fen, " ", sizeof(fen) - strlen(fen) - 1);
+            strncat(fen, args[i], sizeof(fen) - strlen(fen) - 1);
+        }
+    }
+    if (num_threads < 1) num_threads = 1;
+    if (hash_mb) resize_perft_table(hash_mb);
+
+    if (suite) return perft_suite(num_threads, hash_mb > 0) ? 1 : 0;
+
+    ChessBoard_from_FEN(&board, fen);
+
+    if (bench) {
+        bench_make_unmake(&board, depth);
+        bench_slider_attacks(&board, depth);
+        return 0;
     }
 
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    u64 nodes = perft_parallel(&board, depth, num_threads, hash_mb > 0);
+    double t = seconds_since(start);
+
+    if (show_divide) divide();
+    printf("Nodes: %llu\n", nodes);
+    printf("Time: %.3fs\n", t);
+    printf("Speed: %.2f Mnps\n", t > 0 ? nodes / t / 1e6 : 0.0);
+
     return 0;
 }
@@ -1,11 +1,16 @@
+// clock_gettime, pthread_condattr_setclock
+#define _GNU_SOURCE
+
 #include "search.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
 
 #include "board.h"
 #include "common.h"
@@ -15,499 +20,814 @@
 #include "movegen.h"
 
 const i16 MATE = 30000;
-const u64 max_nodes = 35000000;  // ~4 seconds
 const int max_depth = 256;
-const u64 NULL_MOVE = 0;
+const Move NULL_MOVE = 0;
+
+// Quiescence plies in which check evasions are still searched
+#define QS_MAX_EVASIONS 8
 
 // Timing Utilities
+// monotonic, so NTP adjustments can't make a search end early or late
+struct timespec get_current_time(void) {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp;
+}
+
+// minutes:seconds:milliseconds on the timer's clock, so printed times line
+// up with the stop deadline
 void print_time(void) {
-    struct timeval tv;
-    struct tm *timeinfo;
-    char buffer[80];
+    struct timespec tp = get_current_time();
+    long long seconds = tp.tv_sec;
 
-    gettimeofday(&tv, NULL);
-    timeinfo = localtime(&tv.tv_sec);
+    printf("Current time: %02lld:%02lld:%03ld\n", seconds / 60 % 60,
+           seconds % 60, tp.tv_nsec / 1000000);
+}
 
-    strftime(buffer, sizeof(buffer), "%M:%S", timeinfo);
-    printf("Current time: %s:%03d\n", buffer, tv.tv_usec / 1000);
+double elapsed_time(struct timespec start_time) {
+    struct timespec current_time = get_current_time();
+    return (current_time.tv_sec - start_time.tv_sec) +
+           (current_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
 }
 
-struct timeval get_current_time(void) {
-    struct timeval tp;
-    gettimeofday(&tp, NULL);
-    return tp;
+// Threads
+int num_threads = 1;
+SearchThread *threads = NULL;
+
+// Limits of the running search, see uci_search
+static SearchLimits limits;
+
+// Positions played before the root since the last irreversible move, as set
+// by the last position command
+static u64 game_history[256];
+static int game_length = 0;
+
+// Raised by the timer or by the main thread when it is done; the search only
+// tests this flag, it never reads the clock itself.
+static int stop_search = 0;
+
+int search_stopped(void) {
+    return __atomic_load_n(&stop_search, __ATOMIC_RELAXED);
 }
 
-int time_exceeded(struct timeval start_time, double duration) {
-    struct timeval current_time = get_current_time();
-    double elapsed_time =
-        (current_time.tv_sec - start_time.tv_sec) +
-        (current_time.tv_usec - start_time.tv_usec) / 1000000.0;
-    return elapsed_time > duration;
+void set_stop_search(int stop) {
+    __atomic_store_n(&stop_search, stop, __ATOMIC_RELAXED);
 }
 
+void set_threads(int n) {
+    if (n < 1) n = 1;
+    if (n > MAX_THREADS) n = MAX_THREADS;
+
+    free(threads);
+    threads = calloc(n, sizeof(SearchThread));
+    if (threads == NULL) {
+        fprintf(stderr, "Error: could not allocate %d threads [%s(%s):%d]\n",
+                n, __FILE__, __func__, __LINE__);
+        exit(1);
+    }
+    num_threads = n;
+}
+
+void reset_thread(SearchThread *thread, int id, ChessBoard board) {
+    memset(thread, 0, sizeof(SearchThread));
+    thread->id = id;
+    thread->board = board;
+    attach_attack_cache(&thread->board, &thread->attack_cache);
+
+    memcpy(thread->hash_stack, game_history, game_length * sizeof(u64));
+    thread->root_index = game_length;
+}
+
+// Timer: sleeps until the deadline, then raises the stop flag
+static pthread_t timer_thread;
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static struct timespec timer_deadline;
+static int timer_cancelled;
+
+void *timer_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&timer_mutex);
+    while (!timer_cancelled) {
+        if (pthread_cond_timedwait(&timer_cond, &timer_mutex,
+                                   &timer_deadline) == ETIMEDOUT) {
+            set_stop_search(1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&timer_mutex);
+
+    return NULL;
+}
+
+void start_timer(struct timespec start_time, double duration) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (duration < 0) duration = 0;
+    long long ns = start_time.tv_nsec + (long long)(duration * 1000000000.0);
+    timer_deadline.tv_sec = start_time.tv_sec + ns / 1000000000;
+    timer_deadline.tv_nsec = ns % 1000000000;
+    timer_cancelled = 0;
+
+    pthread_create(&timer_thread, NULL, timer_main, NULL);
+}
+
+void stop_timer(void) {
+    pthread_mutex_lock(&timer_mutex);
+    timer_cancelled = 1;
+    pthread_cond_signal(&timer_cond);
+    pthread_mutex_unlock(&timer_mutex);
+
+    pthread_join(timer_thread, NULL);
+    pthread_cond_destroy(&timer_cond);
+}
+
+// Node counters: each thread only writes its own, but search_nodes reads
+// them all while the threads run, so the writes and those reads are atomic
+static void count_node(u64 *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+// total over all threads, read while they are running
+u64 search_nodes(void) {
+    u64 total = 0;
+    for (int i = 0; i < num_threads; i++) {
+        total += __atomic_load_n(&threads[i].nodes, __ATOMIC_RELAXED) +
+                 __atomic_load_n(&threads[i].qnodes, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// Stop flag, plus the node limit: the main thread counts every 1024 of its
+// nodes, so a single threaded search always stops on the same node
+static int search_done(SearchThread *thread) {
+    if (limits.nodes && thread->id == 0 &&
+        ((thread->nodes + thread->qnodes) & 1023) == 0 &&
+        search_nodes() >= limits.nodes)
+        set_stop_search(1);
+
+    return search_stopped();
+}
+
+static int root_move_allowed(Move move) {
+    if (!limits.num_searchmoves) return 1;
+    for (int i = 0; i < limits.num_searchmoves; i++) {
+        if (limits.searchmoves[i] == move) return 1;
+    }
+    return 0;
+}
+
+static int is_mate_score(i16 score) { return abs(score) >= INF - 256; }
+
 // Killer table
-void store_killer(KillerTable *killer_table, u16 ply, u64 move) {
-    if ((killer_table[ply].move1 & 0xFFFFFFF) == (move & 0xFFFFFFF)) return;
+void store_killer(KillerTable *killer_table, u16 ply, Move move) {
+    if (killer_table[ply].move1 == move) return;
     killer_table[ply].move2 = killer_table[ply].move1;
     killer_table[ply].move1 = move;
 }
 
-// Extract PV
-int extract_pv(ChessBoard board, u64 *pv_list, int max_pv) {
-    int num_pv = 0;
-    u64 entry;
-    while (num_pv < max_pv && (entry = probe(board.hash))) {
-        pv_list[num_pv++] = hf_move(entry);
-        board = make_move(board, hf_move(entry));
+// Gravity: entries move by bonus, less so the closer they already are to
+// +-history_max, so they never leave that range and old results fade
+static void update_history(i16 *entry, int bonus) {
+    *entry += bonus - *entry * abs(bonus) / history_max;
+}
+
+static void update_quiet_history(SearchThread *thread, ChessBoard *board,
+                                 Move move, int bonus, u16 ply) {
+    Side side = board->side;
+    int pc = side + moved_piece(board, move), dst = to(move);
+
+    update_history(&thread->history.butterfly[side][from(move)][dst], bonus);
+    for (int i = 1; i <= 2 && i <= ply; i++) {
+        PieceToHistory *cont = thread->cont_stack[ply - i];
+        if (cont) update_history(&(*cont)[pc][dst], bonus);
+    }
+}
+
+static void update_capture_history(SearchThread *thread, ChessBoard *board,
+                                   Move move, int bonus) {
+    Piece p = moved_piece(board, move);
+    Piece captured = captured_piece(board, move);
+    update_history(
+        &thread->history.capture[board->side + p][to(move)][captured / 2],
+        bonus);
+}
+
+// Sets up the continuation history for the children of a move about to be
+// made at ply
+static void push_cont(SearchThread *thread, ChessBoard *board, Move move,
+                      u16 ply) {
+    thread->cont_stack[ply] =
+        &thread->history
+             .continuation[board->side + moved_piece(board, move)][to(move)];
+}
+
+// Draws by the fifty-move rule or by repetition. Any repetition counts,
+// since a line that repeats once can repeat again. Only positions since the
+// last irreversible move (or null move) can repeat, those with the same side
+// to move are every other one.
+static int is_draw(ChessBoard *board, SearchThread *thread, u16 ply) {
+    if (board->halfmove_clock >= 100) return 1;
+
+    int cur = thread->root_index + ply;
+    int end = cur - board->halfmove_clock;
+    for (int i = cur - 4; i >= end && i >= 0; i -= 2) {
+        if (thread->hash_stack[i] == board->hash) return 1;
     }
+    return 0;
+}
 
-    return num_pv;
+// PV
+// line[ply] becomes move followed by the child's line
+static void update_pv(PVTable *pv, u16 ply, Move move) {
+    size_t child = (size_t)ply + 1;
+    size_t child_length = child < MAX_PLY ? (size_t)pv->length[child] : 0;
+
+    pv->line[ply][0] = move;
+    memcpy(&pv->line[ply][1], pv->line[child], child_length * sizeof(Move));
+    pv->length[ply] = (int)child_length + 1;
 }
 
-void print_pv(u64 *pv_list, int num_pv) {
-    printf("PV: ");
+void print_pv(Move *pv_list, int num_pv) {
     for (int i = 0; i < num_pv; i++) {
         char uci[6];
         move_to_uci(pv_list[i], uci);
-        printf("%s ", uci);
+        printf(" %s", uci);
     }
-    printf("\n");
 }
 
 // Search
-u64 nodes = 0, null_prunes = 0;
-u64 stage_hash = 0, stage_capture = 0, stage_quiet = 0, stage_losing = 0;
-u64 cut_hash = 0, cut_capture = 0, cut_quiet = 0, cut_losing = 0;
-
-u64 cut_nodes = 0, first_cut = 0;
-u64 lmr_attempts = 0, lmr_fails = 0;
-i16 alphabeta(int PV, ChessBoard board, KillerTable *killer_table,
-              u64 *counter_move, u64 prev_move, u64 attack_mask, i16 alpha,
-              i16 beta, u16 depth, u16 ply, u64 *best_move,
-              struct timeval start_time, double duration) {
+i16 alphabeta(int PV, ChessBoard *board, SearchThread *thread, Move prev_move,
+              i16 alpha, i16 beta, u16 depth, u16 ply, Move *best_move) {
+    // the root starts off following the last iteration's PV (or the last
+    // one it found, after failing low out of an aspiration window)
+    if (ply == 0) {
+        if (thread->pv.length[0]) {
+            thread->prev_pv_length = thread->pv.length[0];
+            memcpy(thread->prev_pv, thread->pv.line[0],
+                   thread->prev_pv_length * sizeof(Move));
+        }
+        thread->follow_pv = 1;
+    }
+    thread->pv.length[ply] = 0;
+    int pv_node = beta - alpha > 1;
+
+    thread->hash_stack[thread->root_index + ply] = board->hash;
+    if (ply > 0 && is_draw(board, thread, ply)) return 0;
+
+    // no room for a child in the per-ply tables
+    if (ply >= MAX_PLY - 1) return eval(board);
+
     // Recursive base case
     if (depth == 0) {
-        return quiescence(board, alpha, beta, ply, start_time, duration);
+        return quiescence(board, thread, alpha, beta, ply, 0);
     }
 
-    nodes++;
+    count_node(&thread->nodes);
 
     // Time management
-    if (time_exceeded(start_time, duration)) {
+    if (search_done(thread)) {
         return -out_of_time;
     }
 
     i16 old_alpha = alpha;
+    u64 attack_mask = attackers(board, !board->side);
 
     // Null Move Pruning
-    if (!PV && !zugzwang(&board, attack_mask)) {
-        ChessBoard new_board = null_move(board);
-        u64 new_attack_mask = attackers(&new_board, !new_board.side);
-        u64 _move;
+    if (!PV && !zugzwang(board, attack_mask)) {
+        Undo undo;
+        do_null_move(board, &undo);
+        thread->cont_stack[ply] = NULL;
+        Move _move;
         u16 new_depth = depth < 3 ? 0 : depth - 3;
-        i16 score =
-            -alphabeta(0, new_board, killer_table, counter_move, NULL_MOVE,
-                       new_attack_mask, -beta, -beta + 1, new_depth, ply + 1,
-                       &_move, start_time, duration);
+        i16 score = -alphabeta(0, board, thread, NULL_MOVE, -beta, -beta + 1,
+                               new_depth, ply + 1, &_move);
+        undo_null_move(board, &undo);
         if (score == out_of_time) {
             return -out_of_time;
         }
         if (score >= beta) {
-            store(board.hash, lower, beta, depth, 0);
-            null_prunes++;
+            store(board->hash, lower, beta, depth, 0);
+            thread->stats.null_prunes++;
             return beta;
         }
     }
 
-    // Transposition table lookup
-    u64 entry = 0, hash_move = 0;
-    if ((entry = probe(board.hash)) && hf_depth(entry) >= depth) {
+    // Transposition table lookup. A root restricted by searchmoves neither
+    // reads nor writes the table, its result is not the position's.
+    int restricted = ply == 0 && limits.num_searchmoves;
+    u64 entry = 0;
+    Move hash_move = 0;
+    if (!restricted && (entry = probe(board->hash)) &&
+        hf_depth(entry) >= depth) {
         hash_flag_t flag = hf_flag(entry);
         i16 score = hf_score(entry);
         hash_move = flag != higher ? hf_move(entry) : 0;
 
-        if (flag == exact) {
-            *best_move = hash_move;
-            return score;
-        } else if (flag == lower) {
-            alpha = score > alpha ? score : alpha;
-        } else if (flag == higher) {
-            beta = score < beta ? score : beta;
+        // Only non-PV nodes below the root cut off or narrow their window,
+        // so the PV and the best move come from an actual search. The root
+        // and PV nodes still get the hash move first.
+        if (ply > 0 && !pv_node) {
+            if (flag == exact) {
+                *best_move = hash_move;
+                return score;
+            } else if (flag == lower) {
+                alpha = score > alpha ? score : alpha;
+            } else if (flag == higher) {
+                beta = score < beta ? score : beta;
+            }
         }
 
         // beta cutoff
         if (alpha > beta && flag == lower) {
-            store(board.hash, lower, alpha, depth, hash_move);
+            store(board->hash, lower, alpha, depth, hash_move);
             return alpha;
             // raise alpha
         } else if (alpha > beta) {
-            store(board.hash, higher, beta, depth, hash_move);
+            store(board->hash, higher, beta, depth, hash_move);
             return beta;
         }
     }
 
+    // Along the last PV, its move goes first in case the table lost it
+    if (thread->follow_pv) {
+        if (ply < thread->prev_pv_length)
+            hash_move = thread->prev_pv[ply];
+        else
+            thread->follow_pv = 0;
+    }
+
     // Start Search
     int legal_moves = 0;
     i16 best_score = -INF;
     *best_move = 0;
 
-    // Hash move
-    if (hash_move) {
-        stage_hash++;
-        ChessBoard new_board = make_move(board, hash_move);
-        if (is_legal(&new_board, attackers(&new_board, new_board.side),
-                     !new_board.side)) {
-            legal_moves++;
-            u64 _move;
-            i16 score = -alphabeta(
-                PV, new_board, killer_table, counter_move, hash_move,
-                attackers(&new_board, !new_board.side), -beta, -alpha,
-                depth - 1, ply + 1, &_move, start_time, duration);
-            if (score == out_of_time) {
-                return -out_of_time;
-            }
-            if (score >= beta) {
-                cut_hash++;
-                cut_nodes++;
-                first_cut += legal_moves == 1;
-                store(board.hash, lower, beta, depth, hash_move);
-                if (captured(hash_move) == empty) {
-                    store_killer(killer_table, ply, hash_move);
-                    if (prev_move)
-                        counter_move[from(prev_move) * 64 + to(prev_move)] =
-                            (hash_move & 0xFFFFFFF);
-                }
-                return beta;
-            }
-            if (score > alpha) {
-                alpha = score;
-            }
-            if (score > best_score) {
-                best_score = score;
-                *best_move = hash_move;
+    int alpha_raised = 0;
+    int in_check = (attack_mask & board->bitboards[board->side + king]) != 0;
+    i16 static_eval = eval(board);
+    MoveGenInfo info;
+    init_movegen_info(board, attack_mask, &info);
+
+    PieceToHistory *cont[2] = {ply >= 1 ? thread->cont_stack[ply - 1] : NULL,
+                               ply >= 2 ? thread->cont_stack[ply - 2] : NULL};
+    MovePicker picker;
+    init_move_picker(&picker, board, &info, hash_move, thread->killer_table,
+                     thread->counter_move, &thread->history, cont, prev_move,
+                     ply);
+    // moves searched without a cutoff, penalized if a later one cuts
+    Move quiets_tried[64], captures_tried[32];
+    int num_quiets = 0, num_captures = 0;
+    int stage_moves = 0;
+    PickStage last_stage = pick_hash;
+    Move move;
+    while ((move = next_move(&picker))) {
+        if (ply == 0 && !root_move_allowed(move)) {
+            thread->follow_pv = 0;
+            continue;
+        }
+
+        Undo undo;
+        push_cont(thread, board, move, ply);
+        do_move(board, move, &undo);
+        legal_moves++;
+        thread->stats.stage_hash += picker.picked == pick_hash;
+        if (picker.picked != last_stage) stage_moves = 0;
+        last_stage = picker.picked;
+        stage_moves++;
+
+        // the child works out its own attack mask, most children are leaves
+        // that never need it
+        int delivering_check = side_in_check(board);
+        int attacker_attacked = attack_mask & BB_SQUARE(to(move));
+
+        // check extension
+        i16 E = 0;
+        if (delivering_check && ~attacker_attacked) E++;
+
+        // reductions
+        int R = 0;
+
+        // Futility "pruning"
+        if (depth == 2 && E == 0 && !in_check && static_eval + 50 < alpha &&
+            picker.picked != pick_hash)
+            R++;
+
+        // LMR: quiets and losing captures, never the first move
+        Move _move;
+        i16 score;
+        unsigned extended = (unsigned)depth + E, reduction = (unsigned)R + 1;
+        int new_depth = extended > reduction ? (int)(extended - reduction) : 0;
+        int is_pv = (legal_moves == 1) || alpha_raised;
+        int can_lmr = picker.picked >= pick_killers && depth >= 2 && E == 0 &&
+                      !in_check && legal_moves > 1;
+        if (can_lmr) {
+            thread->stats.lmr_attempts++;
+            int lmr_reduce = ((int)sqrt((double)(depth - 1)) +
+                              (int)sqrt((double)(legal_moves - 1)));
+            lmr_reduce = is_pv ? lmr_reduce * 0.5 : lmr_reduce;
+            u16 reduced_depth =
+                new_depth - lmr_reduce < 0 ? 0 : new_depth - lmr_reduce;
+            score = -alphabeta(0, board, thread, move, -(alpha + 1), -alpha,
+                               reduced_depth, ply + 1, &_move);
+
+            if (score > alpha && score < beta) {
+                thread->stats.lmr_fails++;
+                score = -alphabeta(is_pv, board, thread, move, -beta, -alpha,
+                                   new_depth, ply + 1, &_move);
             }
+        } else {
+            score = -alphabeta(is_pv, board, thread, move, -beta, -alpha,
+                               new_depth, ply + 1, &_move);
         }
-    }
+        undo_move(board, move, &undo);
+        thread->follow_pv = 0;  // only ever the first move
 
-    MoveGenStage stage[] = {promotions, captures, quiets, castling, losing};
-    int len = sizeof(stage) / sizeof(stage[0]);
+        // time management
+        if (score == out_of_time) {
+            return -out_of_time;
+        }
 
-    u64 moves[256];
-    int alpha_raised = 0;
-    for (int i = 0; i < len; i++) {
-        int prior_good_moves = 0;
-        if (stage[i] == quiets) prior_good_moves = legal_moves;
-
-        int stage_moves = 0;
-        int num_moves = generate_moves(&board, moves, attack_mask, stage[i]);
-        int moves_left = num_moves;
-        sort_moves(&board, attack_mask, moves, num_moves, killer_table,
-                   counter_move, prev_move, stage[i], ply);
-        while (moves_left) {
-            u64 move = select_move(moves, moves_left--);
-            if (!move) break;
-
-            ChessBoard new_board = make_move(board, move);
-            if (is_legal(&new_board, attackers(&new_board, new_board.side),
-                         !new_board.side)) {
-                legal_moves++;
-                stage_moves++;
-
-                u64 new_attack_mask = attackers(&new_board, !new_board.side);
-
-                int delivering_check =
-                    new_attack_mask &
-                    new_board.bitboards[new_board.side + king];
-                int in_check = attack_mask & board.bitboards[board.side + king];
-                int attacker_attacked = attack_mask & BB_SQUARE(to(move));
-
-                // check extension
-                i16 E = 0;
-                if (delivering_check && ~attacker_attacked) E++;
-
-				// reductions
-				int R = 0;
-
-				// Futility "pruning"
-				if (depth == 2 && E == 0 && !in_check && eval(&board) + 50 < alpha)
-					R++;
-
-                // LMR
-                u64 _move;
-                i16 score;
-                int new_depth = depth + E - R - 1 < 0 ? 0 : depth + E - R - 1;
-                int is_pv = (legal_moves == 1) || alpha_raised;
-                int lmr_legal_moves = prior_good_moves > 0 ? 0 : 1;
-                int can_lmr = (stage[i] == quiets || stage[i] == losing) &&
-                              depth >= 2 && E == 0 && !in_check &&
-                              legal_moves > lmr_legal_moves;
-                if (can_lmr) {
-                    lmr_attempts++;
-                    int lmr_reduce = ((int)sqrt((double)(depth - 1)) +
-                                	  (int)sqrt((double)(legal_moves - 1)));
-					lmr_reduce = is_pv ? lmr_reduce * 0.5 : lmr_reduce;
-                    u16 reduced_depth = new_depth - lmr_reduce < 0 ? 0 : new_depth - lmr_reduce;
-                    score = -alphabeta(0, new_board, killer_table, counter_move,
-                                       move, new_attack_mask, -(alpha + 1),
-                                       -alpha, reduced_depth, ply + 1, &_move,
-                                       start_time, duration);
-                    if (score == out_of_time) return -out_of_time;
-
-                    if (score > alpha && score < beta) {
-                        lmr_fails++;
-                        score = -alphabeta(is_pv, new_board, killer_table,
-                                           counter_move, move, new_attack_mask,
-                                           -beta, -alpha, new_depth, ply + 1,
-                                           &_move, start_time, duration);
-                    }
-                } else {
-                    score = -alphabeta(is_pv, new_board, killer_table,
-                                       counter_move, move, new_attack_mask,
-                                       -beta, -alpha, new_depth, ply + 1,
-                                       &_move, start_time, duration);
-                }
+        if (pv_node && score > alpha) update_pv(&thread->pv, ply, move);
 
-                // time management
-                if (score == out_of_time) {
-                    return -out_of_time;
-                }
+        // beta cutoff
+        if (score >= beta) {
+            if (!restricted) store(board->hash, lower, beta, depth, move);
+
+            thread->stats.cut_nodes++;
+            thread->stats.first_cut += legal_moves == 1;
+
+            int bonus = depth < 8 ? 32 * depth * depth : 2048;
+            if (captured_piece(board, move) == empty &&
+                move_type(move) != PROMOTION) {
+                store_killer(thread->killer_table, ply, move);
+                if (prev_move)
+                    thread->counter_move[from(prev_move) * 64 +
+                                         to(prev_move)] = move;
+
+                update_quiet_history(thread, board, move, bonus, ply);
+                for (int i = 0; i < num_quiets; i++)
+                    update_quiet_history(thread, board, quiets_tried[i],
+                                         -bonus, ply);
+            } else if (captured_piece(board, move) != empty) {
+                update_capture_history(thread, board, move, bonus);
+            }
+            for (int i = 0; i < num_captures; i++)
+                update_capture_history(thread, board, captures_tried[i],
+                                       -bonus);
+
+            switch (picker.picked) {
+                case pick_hash:
+                    thread->stats.cut_hash++;
+                    break;
+                case pick_good_captures:
+                    thread->stats.stage_capture++;
+                    thread->stats.cut_capture += stage_moves;
+                    break;
+                case pick_killers:
+                case pick_counter:
+                case pick_quiets:
+                    thread->stats.stage_quiet++;
+                    thread->stats.cut_quiet += stage_moves;
+                    break;
+                case pick_bad_captures:
+                    thread->stats.stage_losing++;
+                    thread->stats.cut_losing += stage_moves;
+                    break;
+                default:
+                    break;
+            }
+            return beta;
+        }
 
-                // beta cutoff
-                if (score >= beta) {
-                    store(board.hash, lower, beta, depth, move);
-
-                    cut_nodes++;
-                    first_cut += legal_moves == 1;
-
-                    if (stage[i] == quiets) {
-                        store_killer(killer_table, ply, move);
-                        if (prev_move)
-                            counter_move[from(prev_move) * 64 + to(prev_move)] =
-                                (move & 0xFFFFFFF);
-                    }
-
-                    switch (stage[i]) {
-                        case promotions:
-                            break;
-                        case captures:
-                            stage_capture++;
-                            cut_capture += stage_moves;
-                            break;
-                        case castling:
-                            break;
-                        case quiets:
-                            stage_quiet++;
-                            cut_quiet += stage_moves;
-                            break;
-                        case losing:
-                            stage_losing++;
-                            cut_losing += stage_moves;
-                            break;
-                    }
-                    return beta;
-                }
+        if (captured_piece(board, move) != empty) {
+            if (num_captures < 32) captures_tried[num_captures++] = move;
+        } else if (move_type(move) != PROMOTION) {
+            if (num_quiets < 64) quiets_tried[num_quiets++] = move;
+        }
 
-                // raise alpha
-                if (score > alpha) {
-                    alpha = score;
-                    alpha_raised = 1;
-                }
+        // raise alpha
+        if (score > alpha) {
+            alpha = score;
+            alpha_raised = 1;
+        }
 
-                // minimax stuff
-                if (score > best_score) {
-                    best_score = score;
-                    *best_move = move;
-                }
-            }
+        // minimax stuff
+        if (score > best_score) {
+            best_score = score;
+            *best_move = move;
         }
     }
 
+    // none of the searchmoves is legal here: no result
+    if (restricted && legal_moves == 0) return alpha;
+
     // Stalemate and checkmate detection
     if (legal_moves == 0) {
-        if (attack_mask & board.bitboards[board.side + king]) {
-            store(board.hash, exact, -INF + ply, depth, 0);
+        if (attack_mask & board->bitboards[board->side + king]) {
+            store(board->hash, exact, -INF + ply, depth, 0);
             return -INF + ply;
         }
 
-        store(board.hash, exact, 0, depth, 0);
+        store(board->hash, exact, 0, depth, 0);
         return 0;
     }
 
     // Store Transposition Table
-    if (best_score > old_alpha) {
-        store(board.hash, exact, best_score, depth, *best_move);
+    if (restricted) {
+        return best_score;
+    } else if (best_score > old_alpha) {
+        store(board->hash, exact, best_score, depth, *best_move);
     } else
-        store(board.hash, higher, best_score, depth, 0);
+        store(board->hash, higher, best_score, depth, 0);
 
     return best_score;
 }
 
-u64 qnodes = 0, q_stage = 0, q_cut = 0;
-i16 quiescence(ChessBoard board, i16 alpha, i16 beta, u16 ply,
-               struct timeval start_time, double duration) {
-    qnodes++;
+// Captures and promotions until the position is quiet. depth is 0 on entry
+// from the main search and drops by one every ply, the first ply also tries
+// quiet checks. In check there is no standing pat: every evasion is searched,
+// and no evasion means mate.
+i16 quiescence(ChessBoard *board, SearchThread *thread, i16 alpha, i16 beta,
+               u16 ply, int depth) {
+    count_node(&thread->qnodes);
+
+    if (search_done(thread)) return -out_of_time;
+
+    // no room for a child in the per-ply tables, or a long run of checks:
+    // give up on evasions and take the static score
+    int in_check = side_in_check(board);
+    if (ply >= MAX_PLY - 1 || (in_check && depth <= -QS_MAX_EVASIONS)) {
+        return eval(board);
+    }
 
-    if (time_exceeded(start_time, duration)) return -out_of_time;
+    i16 stand_pat = 0;
+    i16 best_score = -INF + ply;
+    if (!in_check) {
+        stand_pat = eval(board);
+        if (stand_pat >= beta) return beta;
 
-    i16 stand_pat = eval(&board);
-    if (stand_pat >= beta) return beta;
+        // Delta pruning
+        if (stand_pat < alpha - 900) return alpha;
 
-	// Delta pruning
-	if (stand_pat < alpha - 900) return alpha;
+        alpha = stand_pat > alpha ? stand_pat : alpha;
+        best_score = stand_pat;
+    }
 
-    alpha = stand_pat > alpha ? stand_pat : alpha;
-    i16 best_score = stand_pat;
-    u64 moves[256];
-    u64 attack_mask = attackers(&board, !board.side);
-    int num_moves = generate_moves(&board, moves, attack_mask, captures);
-    sort_moves(&board, attack_mask, moves, num_moves, NULL, NULL, NULL_MOVE,
-               captures, ply);
+    u64 attack_mask = attackers(board, !board->side);
+    MoveGenInfo info;
+    init_movegen_info(board, attack_mask, &info);
+    MovePicker picker;
+    if (in_check) {
+        PieceToHistory *cont[2] = {
+            ply >= 1 ? thread->cont_stack[ply - 1] : NULL,
+            ply >= 2 ? thread->cont_stack[ply - 2] : NULL};
+        init_move_picker(&picker, board, &info, 0, thread->killer_table,
+                         thread->counter_move, &thread->history, cont, 0,
+                         ply);
+    } else {
+        // skip captures that lose material, or that can't win enough to
+        // reach alpha even with a margin for the positional swing. Quiet
+        // checks win nothing, so they need to be within that margin already.
+        int threshold = alpha - stand_pat - 100;
+        init_capture_picker(&picker, board, &info,
+                            threshold > 0 ? threshold : 0,
+                            depth == 0 && threshold <= 0);
+    }
     int legal_moves = 0;
-    while (num_moves) {
-        u64 move = select_move(moves, num_moves--);
-        if (!move) break;
-        ChessBoard new_board = make_move(board, move);
-        if (is_legal(&new_board, attackers(&new_board, new_board.side),
-                     !new_board.side)) {
-            legal_moves++;
-            i16 score = -quiescence(new_board, -beta, -alpha, ply + 1,
-                                    start_time, duration);
-            if (score == out_of_time) return -out_of_time;
-
-            if (score >= beta) {
-                q_stage++;
-                q_cut += legal_moves;
-                return beta;
-            }
-            if (score > best_score) best_score = score;
-            alpha = score > alpha ? score : alpha;
+    Move move;
+    while ((move = next_move(&picker))) {
+        Undo undo;
+        push_cont(thread, board, move, ply);
+        do_move(board, move, &undo);
+        legal_moves++;
+        i16 score =
+            -quiescence(board, thread, -beta, -alpha, ply + 1, depth - 1);
+        undo_move(board, move, &undo);
+        if (score == out_of_time) return -out_of_time;
+
+        if (score >= beta) {
+            thread->stats.q_stage++;
+            thread->stats.q_cut += legal_moves;
+            return beta;
         }
+        if (score > best_score) best_score = score;
+        alpha = score > alpha ? score : alpha;
     }
 
     return best_score;
 }
 
-void write_pv(u64 *pv_list, int num_pv, char *pv_buf) {
-    int buf_p = 0;
-    for (int i = 0; i < num_pv; i++) {
-        u64 move = pv_list[i];
-        char move_buf[6] = {0};
-        move_to_uci(move, move_buf);
+// Helper threads search the same root to fill the transposition table for
+// the main thread. Odd helpers start one ply deeper so the threads spread
+// over different depths.
+void *helper_search(void *arg) {
+    SearchThread *thread = arg;
+    Move best_move;
 
-        // TODO: bug where h1h1 gets into pv ((0, 0) move)
-        if (strcmp(move_buf, "h1h1") == 0) {
-            break;
-        }
+    for (int depth = 1 + thread->id % 2; depth < max_depth; depth++) {
+        i16 score = alphabeta(1, &thread->board, thread, NULL_MOVE, -INF, INF,
+                              depth, 0, &best_move);
+        if (score == -out_of_time) break;
+    }
 
-        for (int j = 0; move_buf[j]; j++) {
-            pv_buf[buf_p++] = move_buf[j];
+    return NULL;
+}
+
+// UCI info line for the main thread. bound is " lowerbound" or
+// " upperbound" for a score that fell outside the aspiration window, which
+// leaves no line after a fail low, so the last one is shown instead.
+static void print_info(SearchThread *thread, int depth, i16 score,
+                       const char *bound, struct timespec start_time) {
+    u64 total_nodes = search_nodes();
+    double elapsed = elapsed_time(start_time);
+    printf("info depth %d score ", depth);
+    if (is_mate_score(score))  // in moves, negative when getting mated
+        printf("mate %d",
+               score > 0 ? (INF - score + 1) / 2 : -((INF + score) / 2));
+    else
+        printf("cp %d", score);
+    printf("%s nodes %llu nps %llu time %llu pv", bound, total_nodes,
+           (u64)(total_nodes / (elapsed > 0 ? elapsed : 1e-3)),
+           (u64)(elapsed * 1000));
+    if (thread->pv.length[0])
+        print_pv(thread->pv.line[0], thread->pv.length[0]);
+    else
+        print_pv(thread->prev_pv, thread->prev_pv_length);
+    printf("\n");
+    fflush(stdout);
+}
+
+// Aspiration windows: from depth 5 on the root is searched in a window
+// around the last score. A score outside it is only a bound, so the window
+// widens on that side, more each time, and the root is searched again.
+// Bounds are reported as UCI info if start_time is given.
+static i16 aspiration_search(ChessBoard *board, SearchThread *thread,
+                             int depth, i16 last_score, Move *best_move,
+                             struct timespec *start_time) {
+    int delta = 25;
+    int alpha = -INF, beta = INF;
+    if (depth >= 5 && !is_mate_score(last_score)) {
+        alpha = last_score - delta > -INF ? last_score - delta : -INF;
+        beta = last_score + delta < INF ? last_score + delta : INF;
+    }
+
+    while (1) {
+        i16 score = alphabeta(1, board, thread, NULL_MOVE, alpha, beta,
+                              depth, 0, best_move);
+        if (score == -out_of_time) return score;
+
+        if (score <= alpha && alpha > -INF) {
+            if (start_time)
+                print_info(thread, depth, score, " upperbound", *start_time);
+            beta = (alpha + beta) / 2;
+            alpha = score - delta > -INF ? score - delta : -INF;
+        } else if (score >= beta && beta < INF) {
+            if (start_time)
+                print_info(thread, depth, score, " lowerbound", *start_time);
+            beta = score + delta < INF ? score + delta : INF;
+        } else {
+            return score;
         }
-        pv_buf[buf_p++] = ' ';
+        delta += delta / 2;
+    }
+}
+
+static Move any_legal_move(ChessBoard *board) {
+    ExtMove moves[256];
+    MoveGenInfo info;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+
+    MoveGenStage stage[] = {promotions, captures, castling, quiets};
+    for (int i = 0; i < 4; i++) {
+        if (generate_moves(board, moves, &info, stage[i])) return moves[0].move;
     }
-    pv_buf[buf_p - 1] = 0;  // overwrite last space with null
+    return 0;
 }
 
-void uci_search(ChessBoard board, double duration) {
-    nodes = 0;
-    u64 best_move;
-    u64 pv_list[256];
+// Searches board within search_limits and prints bestmove. Besides the
+// limits, the search ends on the stop flag, which the caller clears before
+// starting it so that an early stop command isn't lost.
+void uci_search(ChessBoard board, SearchLimits *search_limits) {
+    Move best_move = 0;
     i16 best_score = -INF;
+    limits = *search_limits;
+    int last_depth = limits.depth && limits.depth < max_depth ? limits.depth
+                                                              : max_depth - 1;
 
-    KillerTable killer_table[256] = {0};
-    u64 counter_move[64 * 64] = {0};
+    struct timespec start_time = get_current_time();
+    age_hash_table();
 
-    struct timeval start_time = get_current_time();
+    // start timer and helpers
+    if (limits.time > 0) start_timer(start_time, limits.time);
+    for (int i = 0; i < num_threads; i++) {
+        reset_thread(&threads[i], i, board);
+    }
+    for (int i = 1; i < num_threads; i++) {
+        pthread_create(&threads[i].handle, NULL, helper_search, &threads[i]);
+    }
 
-    for (int depth = 1; depth < max_depth; depth++) {
-        u64 attack_mask = attackers(&board, !board.side);
-        i16 score = alphabeta(1, board, killer_table, counter_move, NULL_MOVE,
-                              attack_mask, -INF, INF, depth, 0, &best_move,
-                              start_time, duration);
+    SearchThread *thread = &threads[0];
+    for (int depth = 1; depth <= last_depth; depth++) {
+        Move root_move;
+        i16 score = aspiration_search(&board, thread, depth, best_score,
+                                      &root_move, &start_time);
 
         if (score == -out_of_time) break;
         best_score = score;
+        best_move = thread->pv.length[0] ? thread->pv.line[0][0] : root_move;
 
-        // PV
-        int num_pv = extract_pv(board, pv_list, depth);
+        print_info(thread, depth, best_score, "", start_time);
 
-        // Write PV
-        int pv_buf_len = num_pv * 7 + 1;
-        char *pv_buf = malloc(sizeof(char) * pv_buf_len);
-        write_pv(pv_list, num_pv, pv_buf);
+        // mate in n moves is found n * 2 - 1 plies from the root
+        if (limits.mate && best_score > INF - 2 * limits.mate) break;
+    }
 
-        // logging
-        printf("info depth %d score cp %d pv %s\n", depth, best_score, pv_buf);
-        fflush(stdout);
+    // an infinite search keeps its result until told to stop
+    while (limits.infinite && !search_stopped()) {
+        struct timespec wait = {0, 1000000};
+        nanosleep(&wait, NULL);
+    }
 
-        free(pv_buf);
+    // stop and join helpers
+    set_stop_search(1);
+    for (int i = 1; i < num_threads; i++) {
+        pthread_join(threads[i].handle, NULL);
     }
+    if (limits.time > 0) stop_timer();
 
-    char best_move_str[6] = {0};
-    move_to_uci(pv_list[0], best_move_str);
+    // stopped before the first iteration was done
+    if (!best_move) best_move = thread->pv.length[0] ? thread->pv.line[0][0]
+                                                     : any_legal_move(&board);
+
+    char best_move_str[6] = "0000";  // no legal move
+    if (best_move) move_to_uci(best_move, best_move_str);
     printf("bestmove %s\n", best_move_str);
     fflush(stdout);
 }
 
 i16 iterative_deepening(ChessBoard board) {
-    u64 best_move;
+    Move best_move;
     i16 best_score = -INF;
 
-    KillerTable killer_table[256] = {0};
     assert(max_depth == 256);
-    u64 counter_move[64 * 64] = {0};
-    struct timeval start_time = get_current_time();
+    struct timespec start_time = get_current_time();
     const double duration = 400;  // constant for debugging
+    age_hash_table();
+
+    SearchThread *thread = malloc(sizeof(SearchThread));
+    reset_thread(thread, 0, board);
+    set_stop_search(0);
+    start_timer(start_time, duration);
 
     for (int depth = 1; depth < max_depth; depth++) {
         // logging init
-        nodes = 0, qnodes = 0;
-        null_prunes = 0, stage_hash = 0, stage_capture = 0, stage_quiet = 0,
-        stage_losing = 0, q_stage = 0;
-        cut_hash = 0, cut_capture = 0, cut_quiet = 0, cut_losing = 0, q_cut = 0;
-
-        cut_nodes = 0, first_cut = 0;
-        lmr_attempts = 0, lmr_fails = 0;
+        thread->nodes = 0, thread->qnodes = 0;
+        memset(&thread->stats, 0, sizeof(SearchStats));
 
-        u64 attack_mask = attackers(&board, !board.side);
-        i16 score = alphabeta(1, board, killer_table, counter_move, NULL_MOVE,
-                              attack_mask, -INF, INF, depth, 0, &best_move,
-                              start_time, duration);
+        i16 score = aspiration_search(&board, thread, depth, best_score,
+                                      &best_move, NULL);
 
         if (score == -out_of_time) {
-            return best_score;
+            break;
         }
 
         best_score = score;
 
-        // PV
-        u64 pv_list[256];
-        assert(max_depth <= 256);
-        int num_pv = extract_pv(board, pv_list, depth);
-
         // logging
-        char ascii_move[5];
+        SearchStats *stats = &thread->stats;
+        char ascii_move[6];
         move_to_uci(best_move, ascii_move);
 
         printf("depth: %d, nodes: %llu, score: %d, best move: %s\n", depth,
-               nodes, score, ascii_move);
-        printf("qnodes: %llu\n", qnodes);
-        printf("null prunes: %llu\n", null_prunes);
+               thread->nodes, score, ascii_move);
+        printf("qnodes: %llu\n", thread->qnodes);
+        printf("null prunes: %llu\n", stats->null_prunes);
         printf(
             "stages: hash — %llu, capture — %llu, quiet — %llu, losing — %llu, "
             "q — %llu\n",
-            stage_hash, stage_capture, stage_quiet, stage_losing, q_stage);
+            stats->stage_hash, stats->stage_capture, stats->stage_quiet,
+            stats->stage_losing, stats->q_stage);
         printf(
             "cuts: hash — %llu, capture — %llu, quiet — %llu, losing — %llu, q "
             "— %llu\n",
-            cut_hash, cut_capture, cut_quiet, cut_losing, q_cut);
-        printf("cut nodes: %llu, first cut: %llu\n", cut_nodes, first_cut);
-        printf("lmr attempts: %llu, lmr fails: %llu\n", lmr_attempts,
-               lmr_fails);
-        print_pv(pv_list, num_pv);
-        printf("\n");
+            stats->cut_hash, stats->cut_capture, stats->cut_quiet,
+            stats->cut_losing, stats->q_cut);
+        printf("cut nodes: %llu, first cut: %llu\n", stats->cut_nodes,
+               stats->first_cut);
+        printf("lmr attempts: %llu, lmr fails: %llu\n", stats->lmr_attempts,
+               stats->lmr_fails);
+        printf("PV:");
+        print_pv(thread->pv.line[0], thread->pv.length[0]);
+        printf("\n\n");
     }
 
+    stop_timer();
+    free(thread);
     return best_score;
 }
 
@@ -537,8 +857,124 @@ void debug(void) {
 
 char version[] = "October Version 0.0.1";
 
+// Plays the moves of a position command from token on (a leading "moves" is
+// skipped), keeping the positions passed through for repetition detection
+static void play_moves(ChessBoard *board, char *token) {
+    game_length = 0;
+    for (; token != NULL; token = strtok(NULL, " ")) {
+        if (strcmp(token, "moves") == 0) continue;
+
+        if (game_length == 256) {
+            memmove(game_history, game_history + 1, 255 * sizeof(u64));
+            game_length--;
+        }
+        game_history[game_length++] = board->hash;
+
+        *board = make_move(*board, move_from_uci(board, token));
+        if (board->halfmove_clock == 0) game_length = 0;
+    }
+}
+
+static long long next_number(void) {
+    char *token = strtok(NULL, " ");
+    return token ? atoll(token) : 0;
+}
+
+static int go_keyword(char *token) {
+    char *keywords[] = {"wtime",    "btime", "winc",  "binc",
+                        "movestogo", "movetime", "depth", "nodes",
+                        "mate",      "infinite", "ponder", "searchmoves"};
+    int len = sizeof(keywords) / sizeof(keywords[0]);
+    for (int i = 0; i < len; i++) {
+        if (strcmp(token, keywords[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+// Reads a go command, in any order and with any fields left out. A plain go
+// gets 4 seconds, a clock gets its share of the moves to go (30 if not
+// given) plus the increment.
+static void parse_go(char *input, ChessBoard *board, SearchLimits *go) {
+    long long time[2] = {0, 0}, inc[2] = {0, 0}, movestogo = 0, movetime = 0;
+    memset(go, 0, sizeof(SearchLimits));
+
+    strtok(input, " ");  // go
+    char *token = strtok(NULL, " ");
+    while (token != NULL) {
+        if (strcmp(token, "wtime") == 0) {
+            time[white] = next_number();
+        } else if (strcmp(token, "btime") == 0) {
+            time[black] = next_number();
+        } else if (strcmp(token, "winc") == 0) {
+            inc[white] = next_number();
+        } else if (strcmp(token, "binc") == 0) {
+            inc[black] = next_number();
+        } else if (strcmp(token, "movestogo") == 0) {
+            movestogo = next_number();
+        } else if (strcmp(token, "movetime") == 0) {
+            movetime = next_number();
+        } else if (strcmp(token, "depth") == 0) {
+            go->depth = next_number();
+        } else if (strcmp(token, "nodes") == 0) {
+            go->nodes = next_number();
+        } else if (strcmp(token, "mate") == 0) {
+            go->mate = next_number();
+        } else if (strcmp(token, "infinite") == 0) {
+            go->infinite = 1;
+        } else if (strcmp(token, "searchmoves") == 0) {
+            // moves up to the next keyword
+            while ((token = strtok(NULL, " ")) && !go_keyword(token)) {
+                if (go->num_searchmoves < 256)
+                    go->searchmoves[go->num_searchmoves++] =
+                        move_from_uci(board, token);
+            }
+            continue;
+        }
+        token = strtok(NULL, " ");
+    }
+
+    Side side = board->side;
+    if (movetime) {
+        go->time = movetime / 1000.0;
+    } else if (time[side] || inc[side]) {
+        int moves = movestogo ? movestogo : 30;
+        go->time = ((double)time[side] / (moves + 1) + inc[side]) / 1000;
+        // the increment only arrives after the move, so never bet more
+        // than half of what is on the clock
+        if (time[side] > 0 && go->time > time[side] / 2000.0) {
+            go->time = time[side] / 2000.0;
+        }
+    } else if (!go->depth && !go->nodes && !go->mate && !go->infinite) {
+        go->time = 4.0;
+    }
+    if (go->time > 0) {
+        go->time -= 0.05;  // error delta
+        if (go->time < 0.001) go->time = 0.001;
+    }
+}
+
+// The search runs in its own thread, so the listener can take a stop
+static pthread_t uci_thread;
+static int uci_searching = 0;
+static ChessBoard uci_board;
+static SearchLimits uci_limits;
+
+static void *uci_search_thread(void *arg) {
+    (void)arg;
+    uci_search(uci_board, &uci_limits);
+    return NULL;
+}
+
+static void uci_stop(void) {
+    if (!uci_searching) return;
+    set_stop_search(1);
+    pthread_join(uci_thread, NULL);
+    uci_searching = 0;
+}
+
 void uci_listen(void) {
     global_init();
+    set_threads(1);
 
     ChessBoard start_board;
     ChessBoard_from_FEN(
@@ -551,11 +987,29 @@ void uci_listen(void) {
 
     char input[MAX_INPUT_SIZE];
     while (1) {
-        fgets(input, MAX_INPUT_SIZE, stdin);
+        if (fgets(input, MAX_INPUT_SIZE, stdin) == NULL) {
+            // end of input: a search with a limit may finish, then quit
+            int limited = uci_limits.time > 0 || uci_limits.depth ||
+                          uci_limits.nodes || uci_limits.mate;
+            if (uci_searching && limited && !uci_limits.infinite) {
+                pthread_join(uci_thread, NULL);
+                uci_searching = 0;
+            }
+            strcpy(input, "quit");
+        }
         input[strcspn(input, "\n")] = 0;
+        if (input[0] == 0) continue;
+
+        // a running search only carries on through isready, any other
+        // command (stop included) ends it first
+        if (strcmp(input, "isready") != 0) uci_stop();
 
         if (strcmp(input, "uci") == 0) {
             printf("id name %s\n", version);
+            printf("option name Hash type spin default %d min 1 max %d\n",
+                   HASH_TABLE_MB, HASH_TABLE_MAX_MB);
+            printf("option name Threads type spin default 1 min 1 max %d\n",
+                   MAX_THREADS);
             printf("uciok\n");
             continue;
         }
@@ -565,6 +1019,11 @@ void uci_listen(void) {
             continue;
         }
 
+        if (strcmp(input, "ucinewgame") == 0) {
+            clear_hash_table();
+            continue;
+        }
+
         if (strcmp(input, "quit") == 0) {
             break;
         }
@@ -577,27 +1036,31 @@ void uci_listen(void) {
         char first_word[10];
         sscanf(input, "%s ", first_word);
 
-        if (strcmp(first_word, "go") == 0) {
-            double duration = 4.0;
-            char *token = strtok(input, " ");
-            token = strtok(NULL, " ");  // wtime
-            if (token) {
-                int wtime = atoi(strtok(NULL, " "));
-                strtok(NULL, " ");  // discard winc
-                int winc = atoi(strtok(NULL, " "));
-                strtok(NULL, " ");  // discard btime
-                int btime = atoi(strtok(NULL, " "));
-                strtok(NULL, " ");  // discard binc
-                int binc = atoi(strtok(NULL, " "));
-                strtok(NULL, " ");  // discard movestogo
-                int movestogo = atoi(strtok(NULL, " "));
-
-                double wduration = ((double)wtime / (movestogo + 1) + winc) / 1000;
-                double bduration = ((double)btime / (movestogo + 1) + binc) / 1000;
-                duration = board.side == white ? wduration : bduration;
-				duration -= 0.05;  // error delta
+        if (strcmp(first_word, "setoption") == 0) {
+            char name[32] = {0};
+            long long value = 0;
+            if (sscanf(input, "setoption name %31s value %lld", name,
+                       &value) != 2) {
+                continue;
+            }
+
+            // both are spins with min 1; out of range values are ignored,
+            // huge ones are clamped before narrowing
+            if (value < 1) continue;
+            if (strcmp(name, "Hash") == 0) {
+                resize_hash_table(value);
+            } else if (strcmp(name, "Threads") == 0) {
+                set_threads(value > MAX_THREADS ? MAX_THREADS : value);
             }
-            uci_search(board, duration);
+            continue;
+        }
+
+        if (strcmp(first_word, "go") == 0) {
+            parse_go(input, &board, &uci_limits);
+            uci_board = board;
+            set_stop_search(0);
+            uci_searching = 1;
+            pthread_create(&uci_thread, NULL, uci_search_thread, NULL);
             continue;
         }
 
@@ -608,15 +1071,9 @@ void uci_listen(void) {
         if (strstr(input, "position startpos")) {
             board = start_board;  // reset board
 
-            char *token = strtok(input, " ");
-            token = strtok(NULL, " ");
-            token = strtok(NULL, " ");
-            while (token != NULL) {
-                u64 move = move_from_uci(&board, token);
-                board = make_move(board, move);
-
-                token = strtok(NULL, " ");
-            }
+            strtok(input, " ");  // position
+            strtok(NULL, " ");   // startpos
+            play_moves(&board, strtok(NULL, " "));
         }
 
         else if (strstr(input, "position fen")) {
@@ -640,14 +1097,7 @@ void uci_listen(void) {
 
             ChessBoard_from_FEN(&board, fen);
 
-            char *token = strtok(&input[p], " ");
-            token = strtok(NULL, " ");
-            while (token != NULL) {
-                u64 move = move_from_uci(&board, token);
-                board = make_move(board, move);
-
-                token = strtok(NULL, " ");
-            }
+            play_moves(&board, strtok(&input[p], " "));
         }
     }
 }
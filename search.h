@@ -3,24 +3,113 @@
 
 #include "board.h"
 #include "common.h"
+#include "makemove.h"
 
-#include <sys/time.h>
+#include <pthread.h>
+#include <time.h>
 
 // Killer table
 typedef struct {
-    u64 move1;
-    u64 move2;
+    Move move1;
+    Move move2;
 } KillerTable;
 
-void store_killer(KillerTable *killer_table, u16 ply, u64 move);
+void store_killer(KillerTable *killer_table, u16 ply, Move move);
+
+// History tables, kept within +-history_max by the gravity update in
+// update_history
+typedef i16 PieceToHistory[12][64];  // [side + piece][to]
+
+typedef struct {
+    i16 butterfly[2][64][64];  // [side][from][to], quiets
+    i16 capture[12][64][6];    // [side + piece][to][captured / 2]
+    // [side + piece][to] of the move one or two plies back, then as above
+    PieceToHistory continuation[12][64];
+} HistoryTables;
+
+// Deepest ply the search reaches, checks and captures included; sizes the
+// per-ply tables
+#define MAX_PLY 256
+
+// Triangular PV table: line[ply] is the best line found from ply on, its
+// first move followed by the line of the child that move leads to
+typedef struct {
+    Move line[MAX_PLY][MAX_PLY];
+    int length[MAX_PLY];
+} PVTable;
+
+// Statistics (debugging only)
+typedef struct {
+    u64 null_prunes;
+    u64 stage_hash, stage_capture, stage_quiet, stage_losing;
+    u64 cut_hash, cut_capture, cut_quiet, cut_losing;
+    u64 cut_nodes, first_cut;
+    u64 lmr_attempts, lmr_fails;
+    u64 q_stage, q_cut;
+} SearchStats;
+
+#define MAX_THREADS 256
+
+// Per-thread search state. Lazy SMP: every thread runs its own iterative
+// deepening from the same root and they only share the transposition table.
+typedef struct {
+    int id;
+    pthread_t handle;
+
+    // root, with the attack cache of the moves made on it
+    ChessBoard board;
+    AttackCache attack_cache;
+
+    // move ordering
+    KillerTable killer_table[MAX_PLY];
+    Move counter_move[64 * 64];
+    HistoryTables history;
+    // continuation table of the move made at each ply, NULL for a null move
+    PieceToHistory *cont_stack[MAX_PLY];
+
+    // principal variation, and the previous iteration's one, whose moves are
+    // searched first while the search follows it down from the root
+    PVTable pv;
+    Move prev_pv[MAX_PLY];
+    int prev_pv_length;
+    int follow_pv;
+
+    // hashes of the game since its last irreversible move, then of the
+    // search path, root at hash_stack[root_index]
+    u64 hash_stack[256 + MAX_PLY];
+    int root_index;
+
+    u64 nodes, qnodes;
+    SearchStats stats;
+} SearchThread;
+
+// Limits of a search, from the UCI go command, 0 for none
+typedef struct {
+    double time;  // seconds
+    u64 nodes;
+    int depth;
+    int mate;               // stop once a mate in this many moves is found
+    int infinite;           // hold the result until stopped, even when done
+    Move searchmoves[256];  // root moves to search, all if none
+    int num_searchmoves;
+} SearchLimits;
+
+// Threads
+void set_threads(int n);
+void reset_thread(SearchThread *thread, int id, ChessBoard board);
+u64 search_nodes(void);
+
+// Time management
+void start_timer(struct timespec start_time, double duration);
+void stop_timer(void);
+int search_stopped(void);
+void set_stop_search(int stop);
 
 // Search routines
-i16 alphabeta(int PV, ChessBoard board, KillerTable *killer_table,
-              u64 *counter_move, u64 prev_move,
-              u64 attack_mask, i16 alpha, i16 beta, u16 depth, u16 ply,
-              u64 *best_move, struct timeval start_time, double duration);
-i16 quiescence(ChessBoard board, i16 alpha, i16 beta, u16 ply,
-               struct timeval start_time, double duration);
+i16 alphabeta(int PV, ChessBoard *board, SearchThread *thread, Move prev_move,
+              i16 alpha, i16 beta, u16 depth, u16 ply, Move *best_move);
+i16 quiescence(ChessBoard *board, SearchThread *thread, i16 alpha, i16 beta,
+               u16 ply, int depth);
 i16 iterative_deepening(ChessBoard board);
 
 #endif  // SEARCH_H
@@ -1,10 +1,12 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "board.h"
 #include "common.h"
+#include "hash_table.h"
 #include "lookup.h"
 #include "makemove.h"
 #include "movegen.h"
@@ -93,14 +95,14 @@ void test_ChessBoard_to_FEN(void) {
 
 // Utility function to compare move lists
 // O(n^2) but n is small, also I'm lazy
-int compare_move_lists(u64 *expected, u64 *actual, int n) {
+int compare_move_lists(Move *expected, ExtMove *actual, int n) {
     int i, j, found;
     for (i = 0; i < n; i++) {
         found = 0;
 
         for (j = 0; j < n; j++) {
             u64 exp_trunc = expected[i] & 0xfff;  // Truncate to 12 bits
-            u64 act_trunc = actual[j] & 0xfff;    // Truncate to 12 bits
+            u64 act_trunc = actual[j].move & 0xfff;  // Truncate to 12 bits
             if (exp_trunc == act_trunc) {
                 found = 1;
                 break;
@@ -116,7 +118,7 @@ int compare_move_lists(u64 *expected, u64 *actual, int n) {
 void test_extract_pawn_moves(void) {
     ChessBoard board;
     u64 pawn_moves;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     int move_p = 0;
 
     // Test 1: White to move, pawns at the initial position
@@ -128,7 +130,7 @@ void test_extract_pawn_moves(void) {
         extract_pawn_moves(&board, moves, move_p, pawn_moves, SINGLE_PUSH);
     char *expected_uci_1[] = {"a2a3", "b2b3", "c2c3", "d2d3",
                               "e2e3", "f2f3", "g2g3", "h2h3"};
-    u64 expected_moves_1[8];
+    Move expected_moves_1[8];
     for (int i = 0; i < 8; i++) {
         expected_moves_1[i] = move_from_uci(&board, expected_uci_1[i]);
     }
@@ -147,7 +149,7 @@ void test_extract_pawn_moves(void) {
         extract_pawn_moves(&board, moves, move_p, pawn_moves, SINGLE_PUSH);
     char *expected_uci_2[] = {"a7a6", "b7b6", "c7c6", "d7d6",
                               "e7e6", "f7f6", "g7g6", "h7h6"};
-    u64 expected_moves_2[8];
+    Move expected_moves_2[8];
     for (int i = 0; i < 8; i++) {
         expected_moves_2[i] = move_from_uci(&board, expected_uci_2[i]);
     }
@@ -164,7 +166,7 @@ void test_extract_pawn_moves(void) {
     move_p +=
         extract_pawn_moves(&board, moves, move_p, pawn_moves, SINGLE_PUSH);
     char *expected_uci_3[] = {"c5c6", "f6f7"};
-    u64 expected_moves_3[2];
+    Move expected_moves_3[2];
     for (int i = 0; i < 2; i++) {
         expected_moves_3[i] = move_from_uci(&board, expected_uci_3[i]);
     }
@@ -182,7 +184,7 @@ void test_extract_pawn_moves(void) {
     move_p +=
         extract_pawn_moves(&board, moves, move_p, pawn_moves, SINGLE_PUSH);
     char *expected_uci_4[] = {"d4d3", "b4b3"};
-    u64 expected_moves_4[2];
+    Move expected_moves_4[2];
     for (int i = 0; i < 2; i++) {
         expected_moves_4[i] = move_from_uci(&board, expected_uci_4[i]);
     }
@@ -414,8 +416,9 @@ void test_init_magic_rook(void) {
         "00001000"
         "00001000");
     int sq = 27;
-    int ind1 = (occupancy1 * lookup.rook_magic[sq]) >> (64 - 12);
-    u64 magic_moves1 = lookup.rook_move[4096 * sq + ind1];
+    int ind1 = ((occupancy1 & lookup.rook_mask[sq]) * lookup.rook_magic[sq]) >>
+               lookup.rook_shift[sq];
+    u64 magic_moves1 = lookup.rook_move[lookup.rook_offset[sq] + ind1];
     if (magic_moves1 != expected1) {
         printf("Test 1 failed for square 27.\n");
         return;
@@ -439,8 +442,9 @@ void test_init_magic_rook(void) {
         "00010000"
         "00010000"
         "00010000");
-    int ind2 = (occupancy2 * lookup.rook_magic[28]) >> (64 - 12);
-    u64 magic_moves2 = lookup.rook_move[4096 * 28 + ind2];
+    int ind2 = ((occupancy2 & lookup.rook_mask[28]) * lookup.rook_magic[28]) >>
+               lookup.rook_shift[28];
+    u64 magic_moves2 = lookup.rook_move[lookup.rook_offset[28] + ind2];
     if (magic_moves2 != expected2) {
         printf("Test 1 failed for square 28.\n");
         return;
@@ -473,8 +477,9 @@ void test_init_magic_bishop(void) {
         "00101000"
         "01000100");
     sq = 20;
-    ind = (occupancy * lookup.bishop_magic[sq]) >> (64 - 9);
-    magic_moves = lookup.bishop_move[512 * sq + ind];
+    ind = ((occupancy & lookup.bishop_mask[sq]) * lookup.bishop_magic[sq]) >>
+          lookup.bishop_shift[sq];
+    magic_moves = lookup.bishop_move[lookup.bishop_offset[sq] + ind];
     if (magic_moves != expected) {
         printf("[%s %s:%d] Test 1 failed.\n", __func__, __FILE__, __LINE__);
         return;
@@ -500,8 +505,9 @@ void test_init_magic_bishop(void) {
         "00000000"
         "00000000");
     sq = 52;
-    ind = (occupancy * lookup.bishop_magic[sq]) >> (64 - 9);
-    magic_moves = lookup.bishop_move[512 * sq + ind];
+    ind = ((occupancy & lookup.bishop_mask[sq]) * lookup.bishop_magic[sq]) >>
+          lookup.bishop_shift[sq];
+    magic_moves = lookup.bishop_move[lookup.bishop_offset[sq] + ind];
     if (magic_moves != expected) {
         printf("[%s %s:%d] Test 1 failed.\n", __func__, __FILE__, __LINE__);
         return;
@@ -512,7 +518,7 @@ void test_init_magic_bishop(void) {
 
 void test_extract_magic_moves_rook(void) {
     ChessBoard board;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     int move_p = 0;
 
     // Test 1
@@ -525,7 +531,7 @@ void test_extract_magic_moves_rook(void) {
     char *expected_uci_1[] = {"c6c5", "c6d6", "c7a7", "c7b7",
                               "c7d7", "c7e7", "c7c8"};
     const size_t len = sizeof(expected_uci_1) / sizeof(expected_uci_1[0]);
-    u64 expected_moves_1[len];
+    Move expected_moves_1[len];
     for (size_t i = 0; i < len; i++) {
         expected_moves_1[i] = move_from_uci(&board, expected_uci_1[i]);
     }
@@ -550,7 +556,7 @@ void test_extract_magic_moves_rook(void) {
     char actual_uci_2[sizeof(expected_uci_2) / sizeof(expected_uci_2[0])][5];
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_2[i]);
+        move_to_uci(moves[i].move, actual_uci_2[i]);
     }
 
     const size_t len2 = sizeof(expected_uci_2) / sizeof(expected_uci_2[0]);
@@ -585,7 +591,7 @@ void test_extract_magic_moves_rook(void) {
     char actual_uci_3[sizeof(expected_uci_3) / sizeof(expected_uci_3[0])][5];
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_3[i]);
+        move_to_uci(moves[i].move, actual_uci_3[i]);
     }
 
     const size_t len3 = sizeof(expected_uci_3) / sizeof(expected_uci_3[0]);
@@ -611,7 +617,7 @@ void test_extract_magic_moves_rook(void) {
 
 void test_extract_magic_moves_bishop(void) {
     ChessBoard board;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     int move_p = 0;
 
     // Test 1
@@ -627,7 +633,7 @@ void test_extract_magic_moves_bishop(void) {
     char actual_uci_1[sizeof(expected_uci_1) / sizeof(expected_uci_1[0])][5];
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_1[i]);
+        move_to_uci(moves[i].move, actual_uci_1[i]);
     }
 
     const size_t len1 = sizeof(expected_uci_1) / sizeof(expected_uci_1[0]);
@@ -666,7 +672,7 @@ void test_extract_magic_moves_bishop(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_2[i]);
+        move_to_uci(moves[i].move, actual_uci_2[i]);
     }
 
     qsort(expected_uci_2, len2, sizeof(expected_uci_2[0]),
@@ -684,9 +690,39 @@ void test_extract_magic_moves_bishop(void) {
     printf("test_extract_magic_moves_bishop: All tests passed.\n");
 }
 
+void test_pext_attacks(void) {
+    // Test 1: pdep scatters bits into the mask in order
+    if (pdep(0x5, 0xF0F0) != 0x50 || pdep(0x1F, 0xF0F0) != 0x10F0) {
+        printf("[%s %s:%d] Test 1 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    // Test 2: both backends agree on random occupancies
+    int use_pext = lookup.use_pext;
+    for (int i = 0; i < 4096 && pext_supported(); i++) {
+        u64 occ = genrand64_int64() & genrand64_int64();
+        int sq = i & 63;
+        Piece p = i & 64 ? rook : bishop;
+
+        lookup.use_pext = 0;
+        u64 magic_attacks = get_attacks_occ(occ, sq, p);
+        lookup.use_pext = 1;
+        u64 pext_attacks = get_attacks_occ(occ, sq, p);
+        if (magic_attacks != pext_attacks) {
+            lookup.use_pext = use_pext;
+            printf("[%s %s:%d] Test 2 failed.\n", __func__, __FILE__,
+                   __LINE__);
+            return;
+        }
+    }
+    lookup.use_pext = use_pext;
+
+    printf("%s: All tests passed.\n", __func__);
+}
+
 void test_extract_queen_moves(void) {
     ChessBoard board;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     int move_p = 0;
 
     // Test 1
@@ -702,7 +738,7 @@ void test_extract_queen_moves(void) {
     char actual_uci_1[sizeof(expected_uci_1) / sizeof(expected_uci_1[0])][5];
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_1[i]);
+        move_to_uci(moves[i].move, actual_uci_1[i]);
     }
 
     const size_t len1 = sizeof(expected_uci_1) / sizeof(expected_uci_1[0]);
@@ -736,7 +772,7 @@ void test_extract_queen_moves(void) {
     char actual_uci_2[sizeof(expected_uci_2) / sizeof(expected_uci_2[0])][5];
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_2[i]);
+        move_to_uci(moves[i].move, actual_uci_2[i]);
     }
 
     const size_t len2 = sizeof(expected_uci_2) / sizeof(expected_uci_2[0]);
@@ -762,7 +798,7 @@ void test_extract_queen_moves(void) {
 
 void test_extract_king_moves(void) {
     ChessBoard board;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     int move_p = 0;
 
     // Test 1
@@ -784,7 +820,7 @@ void test_extract_king_moves(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_1[i]);
+        move_to_uci(moves[i].move, actual_uci_1[i]);
     }
 
     qsort(expected_uci_1, len1, sizeof(expected_uci_1[0]),
@@ -818,7 +854,7 @@ void test_extract_king_moves(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_2[i]);
+        move_to_uci(moves[i].move, actual_uci_2[i]);
     }
 
     qsort(expected_uci_2, len2, sizeof(expected_uci_2[0]),
@@ -838,7 +874,7 @@ void test_extract_king_moves(void) {
 
 void test_extract_knight_moves(void) {
     ChessBoard board;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     int move_p = 0;
 
     // Test 1
@@ -860,7 +896,7 @@ void test_extract_knight_moves(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_1[i]);
+        move_to_uci(moves[i].move, actual_uci_1[i]);
     }
 
     qsort(expected_uci_1, len1, sizeof(expected_uci_1[0]),
@@ -893,7 +929,7 @@ void test_extract_knight_moves(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_2[i]);
+        move_to_uci(moves[i].move, actual_uci_2[i]);
     }
 
     qsort(expected_uci_2, len2, sizeof(expected_uci_2[0]),
@@ -913,7 +949,7 @@ void test_extract_knight_moves(void) {
 
 void test_pawn_double_push(void) {
     ChessBoard board;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     u64 move_bb = 0;
     int move_p = 0;
 
@@ -936,7 +972,7 @@ void test_pawn_double_push(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_1[i]);
+        move_to_uci(moves[i].move, actual_uci_1[i]);
     }
 
     qsort(expected_uci_1, len1, sizeof(expected_uci_1[0]),
@@ -971,7 +1007,7 @@ void test_pawn_double_push(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_2[i]);
+        move_to_uci(moves[i].move, actual_uci_2[i]);
     }
 
     qsort(expected_uci_2, len2, sizeof(expected_uci_2[0]),
@@ -991,7 +1027,7 @@ void test_pawn_double_push(void) {
 
 void test_pawn_capture(void) {
     ChessBoard board;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     u64 move_bb = 0;
     int move_p = 0;
 
@@ -1018,7 +1054,7 @@ void test_pawn_capture(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_1[i]);
+        move_to_uci(moves[i].move, actual_uci_1[i]);
     }
 
     qsort(expected_uci_1, len1, sizeof(expected_uci_1[0]),
@@ -1056,7 +1092,7 @@ void test_pawn_capture(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_2[i]);
+        move_to_uci(moves[i].move, actual_uci_2[i]);
     }
 
     qsort(expected_uci_2, len2, sizeof(expected_uci_2[0]),
@@ -1076,7 +1112,7 @@ void test_pawn_capture(void) {
 
 void test_pawn_promote(void) {
     ChessBoard board;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     u64 move_bb = 0;
     int move_p = 0;
 
@@ -1102,7 +1138,7 @@ void test_pawn_promote(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_1[i]);
+        move_to_uci(moves[i].move, actual_uci_1[i]);
     }
 
     qsort(expected_uci_1, len1, sizeof(expected_uci_1[0]),
@@ -1140,7 +1176,7 @@ void test_pawn_promote(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_2[i]);
+        move_to_uci(moves[i].move, actual_uci_2[i]);
     }
 
     qsort(expected_uci_2, len2, sizeof(expected_uci_2[0]),
@@ -1160,7 +1196,7 @@ void test_pawn_promote(void) {
 
 void test_pawn_promote_capture(void) {
     ChessBoard board;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     u64 move_bb = 0;
     int move_p = 0;
 
@@ -1190,7 +1226,7 @@ void test_pawn_promote_capture(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_1[i]);
+        move_to_uci(moves[i].move, actual_uci_1[i]);
     }
 
     qsort(expected_uci_1, len1, sizeof(expected_uci_1[0]),
@@ -1230,7 +1266,7 @@ void test_pawn_promote_capture(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_2[i]);
+        move_to_uci(moves[i].move, actual_uci_2[i]);
     }
 
     qsort(expected_uci_2, len2, sizeof(expected_uci_2[0]),
@@ -1250,7 +1286,7 @@ void test_pawn_promote_capture(void) {
 
 void test_pawn_ep(void) {
     ChessBoard board;
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     u64 move_bb = 0;
     int move_p = 0;
 
@@ -1275,7 +1311,7 @@ void test_pawn_ep(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_1[i]);
+        move_to_uci(moves[i].move, actual_uci_1[i]);
     }
 
     qsort(expected_uci_1, len1, sizeof(expected_uci_1[0]),
@@ -1311,7 +1347,7 @@ void test_pawn_ep(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_2[i]);
+        move_to_uci(moves[i].move, actual_uci_2[i]);
     }
 
     qsort(expected_uci_2, len2, sizeof(expected_uci_2[0]),
@@ -1347,7 +1383,7 @@ void test_pawn_ep(void) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci_3[i]);
+        move_to_uci(moves[i].move, actual_uci_3[i]);
     }
 
     qsort(expected_uci_3, len3, sizeof(expected_uci_3[0]),
@@ -1371,7 +1407,7 @@ int run_single_test(char *fen, char expected_uci[][6], int len) {
 
     u64 attacked = attackers(&board, !board.side);
 
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     int move_p = 0;
 
     char actual_uci[256][6];
@@ -1383,7 +1419,7 @@ int run_single_test(char *fen, char expected_uci[][6], int len) {
     }
 
     for (int i = 0; i < move_p; i++) {
-        move_to_uci(moves[i], actual_uci[i]);
+        move_to_uci(moves[i].move, actual_uci[i]);
     }
 
     qsort(expected_uci, len, sizeof(expected_uci[0]),
@@ -1461,6 +1497,520 @@ void test_is_legal(void) {
     printf("%s: All tests passed.\n", __func__);
 }
 
+// perft that also checks every generated move is legal
+u64 legal_perft(ChessBoard *board, int depth) {
+    if (depth == 0) return 1;
+
+    u64 nodes = 0;
+    ExtMove moves[256];
+    Undo undo;
+    MoveGenInfo info;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+
+    MoveGenStage stage[] = {promotions, captures, castling, quiets};
+    int len = sizeof(stage) / sizeof(stage[0]);
+    for (int i = 0; i < len; i++) {
+        int num_moves = generate_moves(board, moves, &info, stage[i]);
+        for (int move_p = 0; move_p < num_moves; move_p++) {
+            do_move(board, moves[move_p].move, &undo);
+            assert(is_legal(board, attackers(board, board->side),
+                            !board->side));
+            nodes += legal_perft(board, depth - 1);
+            undo_move(board, moves[move_p].move, &undo);
+        }
+    }
+
+    return nodes;
+}
+
+// mailbox agrees with the bitboards on every square
+int mailbox_ok(ChessBoard *board) {
+    for (int sq = 0; sq < 64; sq++) {
+        Piece expected = empty;
+        for (int i = 0; i < 12; i++) {
+            if (BB_GET(board->bitboards[i], sq)) expected = i & ~1;
+        }
+        if (board->mailbox[sq] != expected) return 0;
+    }
+    return 1;
+}
+
+int mailbox_walk(ChessBoard *board, int depth) {
+    if (!mailbox_ok(board)) return 0;
+    if (depth == 0) return 1;
+
+    ExtMove moves[256];
+    Undo undo;
+    MoveGenInfo info;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+
+    MoveGenStage stage[] = {promotions, captures, castling, quiets};
+    int len = sizeof(stage) / sizeof(stage[0]);
+    for (int i = 0; i < len; i++) {
+        int num_moves = generate_moves(board, moves, &info, stage[i]);
+        for (int move_p = 0; move_p < num_moves; move_p++) {
+            do_move(board, moves[move_p].move, &undo);
+            int ok = mailbox_walk(board, depth - 1);
+            undo_move(board, moves[move_p].move, &undo);
+            if (!ok || !mailbox_ok(board)) return 0;
+        }
+    }
+
+    return 1;
+}
+
+void test_mailbox(void) {
+    ChessBoard board;
+
+    // Test 1: castling, en passant and captures (kiwipete)
+    ChessBoard_from_FEN(&board,
+                        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/"
+                        "R3K2R w KQkq - 0 1");
+    if (!mailbox_walk(&board, 3)) {
+        printf("[%s %s:%d] Test 1 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    // Test 2: promotions and capture promotions
+    ChessBoard_from_FEN(&board,
+                        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/"
+                        "R2Q1RK1 w kq - 0 1");
+    if (!mailbox_walk(&board, 3)) {
+        printf("[%s %s:%d] Test 2 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    printf("%s: All tests passed.\n", __func__);
+}
+
+// attack cache agrees with a fresh computation
+int attacks_ok(ChessBoard *board) {
+    sync_attacks(board);
+    for (int sq = 0; sq < 64; sq++) {
+        if (board->cache->attacks[sq] != piece_attacks(board, sq)) return 0;
+    }
+    return attackers(board, white) ==
+               attackers_occ(board, white, board->bitboards[all_pieces + all]) &&
+           attackers(board, black) ==
+               attackers_occ(board, black, board->bitboards[all_pieces + all]);
+}
+
+// Every other move is taken back without the cache being read, so both ways
+// undo_move has of restoring it are covered
+int attacks_walk(ChessBoard *board, int depth) {
+    if (!attacks_ok(board)) return 0;
+    if (depth == 0) return 1;
+
+    ExtMove moves[256];
+    Undo undo;
+    MoveGenInfo info;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+
+    MoveGenStage stage[] = {promotions, captures, castling, quiets};
+    int len = sizeof(stage) / sizeof(stage[0]);
+    for (int i = 0; i < len; i++) {
+        int num_moves = generate_moves(board, moves, &info, stage[i]);
+        for (int move_p = 0; move_p < num_moves; move_p++) {
+            int ok = 1;
+            do_move(board, moves[move_p].move, &undo);
+            if (move_p % 2) ok = attacks_walk(board, depth - 1);
+            undo_move(board, moves[move_p].move, &undo);
+            if (!ok || !attacks_ok(board)) return 0;
+        }
+    }
+
+    return 1;
+}
+
+void test_attack_cache(void) {
+    static AttackCache cache;
+    ChessBoard board;
+    Undo undo;
+    char *fens[] = {
+        // castling, en passant and captures (kiwipete)
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        // promotions and capture promotions
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+        // en passant discovering a rook on the king's rank
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    };
+
+    for (int i = 0; i < 3; i++) {
+        ChessBoard_from_FEN(&board, fens[i]);
+        attach_attack_cache(&board, &cache);
+        if (!attacks_walk(&board, 3)) {
+            printf("[%s %s:%d] Test %d failed.\n", __func__, __FILE__, __LINE__,
+                   i + 1);
+            return;
+        }
+    }
+
+    // the queen's ray opens after e2e4 and closes again on undo
+    ChessBoard_from_FEN(
+        &board, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    attach_attack_cache(&board, &cache);
+    Move e2e4 = move_from_uci(&board, "e2e4");
+    u64 queen_before = make_bitboard(
+        "00000000"
+        "00000000"
+        "00000000"
+        "00000000"
+        "00000000"
+        "00000000"
+        "00111000"
+        "00101000");
+    u64 queen_after = make_bitboard(
+        "00000000"
+        "00000000"
+        "00000000"
+        "00000001"
+        "00000010"
+        "00000100"
+        "00111000"
+        "00101000");
+    int d1 = 4;
+    do_move(&board, e2e4, &undo);
+    sync_attacks(&board);
+    int opened = board.cache->attacks[d1] == queen_after;
+    undo_move(&board, e2e4, &undo);
+    if (!opened || board.cache->attacks[d1] != queen_before) {
+        printf("[%s %s:%d] Test 4 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    // copy-make leaves the cache with the original board
+    ChessBoard_from_FEN(&board, fens[0]);
+    attach_attack_cache(&board, &cache);
+    ChessBoard next = make_move(board, move_from_uci(&board, "e5f7"));
+    if (next.cache != NULL || !attacks_ok(&board) ||
+        attackers(&next, white) !=
+            attackers_occ(&next, white, next.bitboards[all_pieces + all])) {
+        printf("[%s %s:%d] Test 5 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    printf("%s: All tests passed.\n", __func__);
+}
+
+void test_see(void) {
+    struct {
+        char *fen, *move;
+        int value;
+    } cases[] = {
+        // undefended pawn
+        {"1k1r4/1pp4p/p7/4p3/8/P5P1/1PP4P/2K1R3 w - - 0 1", "e1e5", 100},
+        // knight for a pawn after the whole exchange on e5
+        {"1k1r3q/1ppn3p/p4b2/4p3/8/P2N2P1/1PP1R1BP/2K1Q3 w - - 0 1", "d3e5",
+         -220},
+        // the second rook only joins through the first
+        {"3rk3/8/8/3p4/8/8/3R4/3RK3 w - - 0 1", "d2d5", 100},
+        {"3rk3/8/8/3p4/8/8/3R4/4K3 w - - 0 1", "d2d5", -400},
+        // the king can't recapture a defended piece
+        {"3rk3/8/8/8/8/4p3/3PK3/8 b - - 0 1", "e3d2", 100},
+        // en passant, with and without a knight to take back
+        {"4k3/8/8/8/3Pp3/8/8/4K3 b - d3 0 1", "e4d3", 100},
+        {"4k3/8/8/8/3Pp3/8/1N6/4K3 b - d3 0 1", "e4d3", 0},
+    };
+    int len = sizeof(cases) / sizeof(cases[0]);
+
+    for (int i = 0; i < len; i++) {
+        ChessBoard board;
+        ChessBoard_from_FEN(&board, cases[i].fen);
+        Move move = move_from_uci(&board, cases[i].move);
+        int value = see(&board, move);
+        if (value != cases[i].value) {
+            printf("[%s %s:%d] Test %d failed: %d != %d\n", __func__,
+                   __FILE__, __LINE__, i + 1, value, cases[i].value);
+            return;
+        }
+    }
+
+    printf("%s: All tests passed.\n", __func__);
+}
+
+// generate_quiet_checks must return exactly the quiet moves that give check
+int quiet_checks_ok(ChessBoard *board) {
+    ExtMove quiet_moves[256], checks[256];
+    MoveGenInfo info;
+    Undo undo;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+
+    int num_quiets = generate_moves(board, quiet_moves, &info, quiets);
+    int num_checks = generate_moves(board, checks, &info, quiet_checks);
+
+    int expected = 0;
+    for (int i = 0; i < num_quiets; i++) {
+        Move move = quiet_moves[i].move;
+        do_move(board, move, &undo);
+        int check = side_in_check(board);
+        undo_move(board, move, &undo);
+        if (!check) continue;
+
+        expected++;
+        int found = 0;
+        for (int j = 0; j < num_checks; j++) found |= checks[j].move == move;
+        if (!found) return 0;
+    }
+
+    return num_checks == expected;
+}
+
+int quiet_checks_walk(ChessBoard *board, int depth) {
+    if (!quiet_checks_ok(board)) return 0;
+    if (depth == 0) return 1;
+
+    ExtMove moves[256];
+    MoveGenInfo info;
+    Undo undo;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+
+    int num_moves = 0;
+    MoveGenStage stage[] = {promotions, captures, castling, quiets};
+    for (int i = 0; i < 4; i++) {
+        num_moves += generate_moves(board, moves + num_moves, &info, stage[i]);
+    }
+
+    for (int i = 0; i < num_moves; i++) {
+        do_move(board, moves[i].move, &undo);
+        int ok = quiet_checks_walk(board, depth - 1);
+        undo_move(board, moves[i].move, &undo);
+        if (!ok) return 0;
+    }
+
+    return 1;
+}
+
+void test_quiet_checks(void) {
+    ChessBoard board;
+    char *fens[] = {
+        // kiwipete
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        // pins and checks along the ranks
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+        // double checks and discovered checks
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+        // discoveries by a pawn push, a knight and the king
+        "7k/8/8/R2P4/8/2P1N3/1B6/K7 w - - 0 1",
+        "k7/8/8/8/8/8/K7/R7 w - - 0 1",
+    };
+    int len = sizeof(fens) / sizeof(fens[0]);
+
+    for (int i = 0; i < len; i++) {
+        ChessBoard_from_FEN(&board, fens[i]);
+        if (!quiet_checks_walk(&board, i < 3 ? 2 : 3)) {
+            printf("[%s %s:%d] Test %d failed.\n", __func__, __FILE__, __LINE__,
+                   i + 1);
+            return;
+        }
+    }
+
+    // every move of the generator checks, whatever the discovering piece
+    ChessBoard_from_FEN(&board, fens[4]);
+    ExtMove moves[256];
+    MoveGenInfo info;
+    init_movegen_info(&board, attackers(&board, !board.side), &info);
+    if (generate_quiet_checks(&board, moves, &info) != 3) {
+        printf("[%s %s:%d] Test %d failed.\n", __func__, __FILE__, __LINE__,
+               len + 1);
+        return;
+    }
+
+    printf("%s: All tests passed.\n", __func__);
+}
+
+
+// Perft through the move picker. Every move played at a ply becomes the hash
+// move, a killer and a counter move for its siblings and cousins, so the
+// picker sees plenty of moves that are illegal where they are tried.
+Move picker_hash[16];
+KillerTable picker_killers[16];
+Move picker_counters[64 * 64];
+HistoryTables picker_history;
+PieceToHistory *picker_cont[16];
+
+u64 picker_perft(ChessBoard *board, int depth, int ply, Move prev_move) {
+    if (depth == 0) return 1;
+
+    u64 nodes = 0;
+    Move move;
+    Undo undo;
+    MoveGenInfo info;
+    init_movegen_info(board, attackers(board, !board->side), &info);
+
+    PieceToHistory *cont[2] = {ply >= 1 ? picker_cont[ply - 1] : NULL,
+                               ply >= 2 ? picker_cont[ply - 2] : NULL};
+    MovePicker picker;
+    init_move_picker(&picker, board, &info, picker_hash[ply], picker_killers,
+                     picker_counters, &picker_history, cont, prev_move, ply);
+    while ((move = next_move(&picker))) {
+        Piece p = moved_piece(board, move);
+        picker_cont[ply] =
+            &picker_history.continuation[board->side + p][to(move)];
+        do_move(board, move, &undo);
+        assert(is_legal(board, attackers(board, board->side), !board->side));
+        nodes += picker_perft(board, depth - 1, ply + 1, move);
+        undo_move(board, move, &undo);
+
+        picker_hash[ply] = move;
+        if (captured_piece(board, move) == empty) {
+            picker_killers[ply].move2 = picker_killers[ply].move1;
+            picker_killers[ply].move1 = move;
+            if (prev_move)
+                picker_counters[from(prev_move) * 64 + to(prev_move)] = move;
+        }
+    }
+
+    return nodes;
+}
+
+void test_move_picker(void) {
+    ChessBoard board;
+
+    // Test 1: kiwipete
+    ChessBoard_from_FEN(&board,
+                        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/"
+                        "R3K2R w KQkq - 0 1");
+    if (picker_perft(&board, 3, 0, 0) != 97862) {
+        printf("[%s %s:%d] Test 1 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    // Test 2: pins and en passant
+    ChessBoard_from_FEN(&board, "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1");
+    if (picker_perft(&board, 4, 0, 0) != 43238) {
+        printf("[%s %s:%d] Test 2 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    // Test 3: evasions and promotions
+    ChessBoard_from_FEN(&board,
+                        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/"
+                        "R2Q1RK1 w kq - 0 1");
+    if (picker_perft(&board, 3, 0, 0) != 9467) {
+        printf("[%s %s:%d] Test 3 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    // Test 4: history only reorders, whatever is in the tables
+    i16 *entry = (i16 *)&picker_history;
+    for (size_t i = 0; i < sizeof(picker_history) / sizeof(i16); i++) {
+        entry[i] = (i16)(genrand64_int64() % (2 * history_max + 1)) -
+                   history_max;
+    }
+    ChessBoard_from_FEN(&board,
+                        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/"
+                        "R3K2R w KQkq - 0 1");
+    u64 nodes = picker_perft(&board, 3, 0, 0);
+    memset(&picker_history, 0, sizeof(picker_history));
+    if (nodes != 97862) {
+        printf("[%s %s:%d] Test 4 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    printf("%s: All tests passed.\n", __func__);
+}
+
+void test_legal_movegen(void) {
+    ChessBoard board;
+
+    // Test 1: pins, checks and en passant exposing the king along a rank
+    ChessBoard_from_FEN(&board, "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1");
+    if (legal_perft(&board, 4) != 43238) {
+        printf("[%s %s:%d] Test 1 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    // Test 2: evasions by capture, block and king move, pinned promotions
+    ChessBoard_from_FEN(&board,
+                        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/"
+                        "R2Q1RK1 w kq - 0 1");
+    if (legal_perft(&board, 3) != 9467) {
+        printf("[%s %s:%d] Test 2 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    // Test 3: double checks and discovered checks
+    ChessBoard_from_FEN(
+        &board, "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8");
+    if (legal_perft(&board, 3) != 62379) {
+        printf("[%s %s:%d] Test 3 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    printf("%s: All tests passed.\n", __func__);
+}
+
+// Hash table stress test: threads store and probe entries whose contents are
+// a pure function of the hash, so any entry returned for a hash that doesn't
+// match it must have been corrupted by a concurrent write.
+#define HT_THREADS 8
+#define HT_KEYS (1 << 17)
+#define HT_OPS (1 << 19)
+
+u64 ht_mix(u64 x) {
+    // splitmix64 finalizer
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+i16 ht_score(u64 hash) { return (hash >> 8 & 0x3FFF) - 0x2000; }
+u16 ht_depth(u64 hash) { return 1 + (hash >> 24 & 0x7F); }
+Move ht_move(u64 hash) { return 1 + (hash >> 32 & 0x7FFE); }
+
+void *ht_worker(void *arg) {
+    u64 state = ht_mix((u64)(size_t)arg);
+    u64 *bad = malloc(sizeof(u64));
+    *bad = 0;
+
+    for (int i = 0; i < HT_OPS; i++) {
+        state = ht_mix(state);
+        u64 hash = ht_mix(state % HT_KEYS);
+
+        if (state & (1ULL << 63)) {
+            store(hash, exact, ht_score(hash), ht_depth(hash), ht_move(hash));
+        } else {
+            u64 entry = probe(hash);
+            if (entry && (hf_score(entry) != ht_score(hash) ||
+                          hf_depth(entry) != ht_depth(hash) ||
+                          hf_move(entry) != ht_move(hash))) {
+                (*bad)++;
+            }
+        }
+    }
+
+    return bad;
+}
+
+void test_hash_table_threads(void) {
+    pthread_t threads[HT_THREADS];
+    u64 bad = 0;
+
+    // small table so threads fight over the same buckets
+    resize_hash_table(1);
+
+    for (int i = 0; i < HT_THREADS; i++) {
+        pthread_create(&threads[i], NULL, ht_worker, (void *)(size_t)(i + 1));
+    }
+    for (int i = 0; i < HT_THREADS; i++) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        bad += *(u64 *)ret;
+        free(ret);
+    }
+
+    resize_hash_table(HASH_TABLE_MB);
+
+    if (bad) {
+        printf("[%s %s:%d] %llu corrupted entries returned.\n", __func__,
+               __FILE__, __LINE__, bad);
+        return;
+    }
+
+    printf("%s: All tests passed.\n", __func__);
+}
+
 void fuzz_generate_moves(void) {
     ChessBoard board;
     u64 attacked;
@@ -1477,22 +2027,24 @@ void fuzz_generate_moves(void) {
     while (fgets(fen, 99, fptr) != NULL) {
         fen[strcspn(fen, "\n")] = '\0';
 
-        u64 moves[256] = {0};
+        ExtMove moves[256] = {0};
         char ascii_moves[256][6] = {0};
         int num_moves = 0;
 
         ChessBoard_from_FEN(&board, fen);
         attacked = attackers(&board, !board.side);
+        MoveGenInfo info;
+        init_movegen_info(&board, attacked, &info);
 
         MoveGenStage stage[] = {promotions, captures, castling, quiets};
         int len = sizeof(stage) / sizeof(stage[0]);
         for (int i = 0; i < len; i++) {
             num_moves +=
-                generate_moves(&board, moves + num_moves, attacked, stage[i]);
+                generate_moves(&board, moves + num_moves, &info, stage[i]);
         }
 
         for (int i = 0; i < num_moves; i++) {
-            move_to_uci(moves[i], ascii_moves[i]);
+            move_to_uci(moves[i].move, ascii_moves[i]);
         }
 
         qsort(ascii_moves, num_moves, sizeof(ascii_moves[0]),
@@ -1506,11 +2058,42 @@ void fuzz_generate_moves(void) {
     }
 }
 
+void test_perft_table(void) {
+    u64 nodes;
+    u64 hash = 0x0123456789abcdefULL;
+
+    resize_perft_table(1);
+
+    // Test 1: counts are keyed by depth and kept at full width
+    perft_store(hash, 5, 0xfedcba9876543210ULL);
+    perft_store(hash, 6, 42);
+    if (!perft_probe(hash, 5, &nodes) || nodes != 0xfedcba9876543210ULL ||
+        !perft_probe(hash, 6, &nodes) || nodes != 42 ||
+        perft_probe(hash, 7, &nodes)) {
+        printf("[%s %s:%d] Test 1 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    // Test 2: a full bucket gives up its shallowest entry
+    clear_perft_table();
+    for (int depth = 2; depth < 2 + BUCKET_SIZE; depth++) {
+        perft_store(hash, depth, depth);
+    }
+    perft_store(hash ^ 0x100, 9, 9);
+    if (perft_probe(hash, 2, &nodes) || !perft_probe(hash, 3, &nodes) ||
+        !perft_probe(hash ^ 0x100, 9, &nodes) || nodes != 9) {
+        printf("[%s %s:%d] Test 2 failed.\n", __func__, __FILE__, __LINE__);
+        return;
+    }
+
+    printf("%s: All tests passed.\n", __func__);
+}
+
 void test_legal_move(void) {
     ChessBoard board;
     u64 attacked;
 
-    u64 moves[256] = {0};
+    ExtMove moves[256] = {0};
     char ascii_moves[256][6] = {0};
     int ascii_move_p = 0;
     int num_moves = 0;
@@ -1518,17 +2101,19 @@ void test_legal_move(void) {
     ChessBoard_from_FEN(
         &board, "1N3k1r/p6p/1b5n/1QP3p1/1P3pK1/7P/R1r1NBPR/1N3B2 w - - 4 26");
     attacked = attackers(&board, !board.side);
+    MoveGenInfo info;
+    init_movegen_info(&board, attacked, &info);
 
     MoveGenStage stage[] = {promotions, captures, castling, quiets};
     int len = sizeof(stage) / sizeof(stage[0]);
     for (int i = 0; i < len; i++) {
-        num_moves = generate_moves(&board, moves, attacked, stage[i]);
+        num_moves = generate_moves(&board, moves, &info, stage[i]);
 
         for (int move_p = 0; move_p < num_moves; move_p++) {
-            ChessBoard new_board = make_move(board, moves[move_p]);
+            ChessBoard new_board = make_move(board, moves[move_p].move);
             if (is_legal(&new_board, attackers(&new_board, new_board.side),
                          !new_board.side)) {
-                move_to_uci(moves[move_p], ascii_moves[ascii_move_p++]);
+                move_to_uci(moves[move_p].move, ascii_moves[ascii_move_p++]);
             }
         }
     }
@@ -1559,24 +2144,26 @@ void fuzz_legal_moves(void) {
     while (fgets(fen, 99, fptr) != NULL) {
         fen[strcspn(fen, "\n")] = '\0';
 
-        u64 moves[256] = {0};
+        ExtMove moves[256] = {0};
         char ascii_moves[256][6] = {0};
         int ascii_move_p = 0;
         int num_moves = 0;
 
         ChessBoard_from_FEN(&board, fen);
         attacked = attackers(&board, !board.side);
+        MoveGenInfo info;
+        init_movegen_info(&board, attacked, &info);
 
         MoveGenStage stage[] = {promotions, captures, castling, quiets};
         int len = sizeof(stage) / sizeof(stage[0]);
         for (int i = 0; i < len; i++) {
-            num_moves = generate_moves(&board, moves, attacked, stage[i]);
+            num_moves = generate_moves(&board, moves, &info, stage[i]);
 
             for (int move_p = 0; move_p < num_moves; move_p++) {
-                ChessBoard new_board = make_move(board, moves[move_p]);
+                ChessBoard new_board = make_move(board, moves[move_p].move);
                 if (is_legal(&new_board, attackers(&new_board, new_board.side),
                              !new_board.side)) {
-                    move_to_uci(moves[move_p], ascii_moves[ascii_move_p++]);
+                    move_to_uci(moves[move_p].move, ascii_moves[ascii_move_p++]);
                 }
             }
         }
@@ -1630,6 +2217,7 @@ void unit_test(void) {
 
     test_extract_magic_moves_rook();
     test_extract_magic_moves_bishop();
+    test_pext_attacks();
     test_extract_queen_moves();
     test_extract_king_moves();
     test_extract_knight_moves();
@@ -1642,6 +2230,15 @@ void unit_test(void) {
     test_gen_castling();
 
     test_is_legal();
+    test_legal_movegen();
+    test_mailbox();
+    test_attack_cache();
+    test_see();
+    test_move_picker();
+    test_quiet_checks();
+
+    test_hash_table_threads();
+    test_perft_table();
 
     printf("Finished unit tests.\n");
 }